@@ -4,17 +4,23 @@
 #include <engine.hh>
 #include <configuration.hh>
 #include <filter.hh>
+#include <spsc-ring.hh>
 #include <signal.h>
+#include <sched.h>
+#include <pthread.h>
 
 #include <unordered_map>
+#include <map>
 #include <string>
 #include <vector>
+#include <mutex>
 
 using namespace kcov;
 
 class Collector :
 		public ICollector,
 		public IFileParser::ILineListener,
+		public IFileParser::IFunctionListener,
 		public IEngine::IEventListener
 {
 public:
@@ -22,9 +28,17 @@ public:
 		m_fileParser(fileParser),
 		m_engine(engine),
 		m_exitCode(-1),
-		m_filter(filter)
+		m_filter(filter),
+		m_pipelined(false),
+		m_coalesceLines(IConfiguration::getInstance().keyAsInt("coalesce-lines")),
+		m_lazyArming(IConfiguration::getInstance().keyAsInt("lazy-arming")),
+		m_hitRing(16),
+		m_reportThreadValid(false),
+		m_reportThreadShouldExit(false)
 	{
 		m_fileParser.registerLineListener(*this);
+		if (m_lazyArming)
+			m_fileParser.registerFunctionListener(*this);
 	}
 
 	void registerListener(ICollector::IListener &listener)
@@ -37,6 +51,11 @@ public:
 		m_eventTickListeners.push_back(&listener);
 	}
 
+	void registerBreakpointFilter(IBreakpointFilter &filter)
+	{
+		m_breakpointFilters.push_back(&filter);
+	}
+
 	int run(const std::string &filename)
 	{
 		if (!m_engine.start(*this, filename)) {
@@ -44,8 +63,16 @@ public:
 			return -1;
 		}
 
+		m_pipelined = IConfiguration::getInstance().keyAsInt("pipelined-reporting");
+		if (m_pipelined)
+			startReportThread();
+
 		// This will set all breakpoints
-		m_fileParser.parse();
+		{
+			std::lock_guard<std::mutex> lock(m_listenerMutex);
+
+			m_fileParser.parse();
+		}
 
 		while (1) {
 			bool shouldContinue = m_engine.continueExecution();
@@ -56,6 +83,9 @@ public:
 				break;
 		}
 
+		if (m_pipelined)
+			stopReportThread();
+
 		return m_exitCode;
 	}
 
@@ -66,6 +96,8 @@ public:
 private:
 	void tick()
 	{
+		std::lock_guard<std::mutex> lock(m_listenerMutex);
+
 		for (EventTickListenerList_t::iterator it = m_eventTickListeners.begin();
 				it != m_eventTickListeners.end();
 				++it)
@@ -153,11 +185,18 @@ private:
 			m_exitCode = ev.data;
 			break;
 		case ev_breakpoint:
-			for (ListenerList_t::const_iterator it = m_listeners.begin();
-					it != m_listeners.end();
-					++it)
-				(*it)->onAddressHit(ev.addr, 1);
+			if (m_lazyArming)
+				armFunction(ev.addr);
 
+			if (m_coalesceLines)
+				clearLineBreakpoints(ev.addr);
+
+			if (m_pipelined) {
+				queueHit(ev.addr);
+				break;
+			}
+
+			reportHit(ev.addr);
 			break;
 
 		default:
@@ -166,6 +205,200 @@ private:
 	}
 
 
+	/*
+	 * Line coalescing: The first hit on a line is enough, so remove the
+	 * breakpoints on the other addresses of the line.
+	 */
+	void clearLineBreakpoints(uint64_t addr)
+	{
+		AddrToLineMap_t::const_iterator it = m_addrToLine.find(addr);
+
+		if (it == m_addrToLine.end())
+			return;
+
+		std::vector<uint64_t> &addrs = m_lineAddresses[it->second];
+
+		// Already done for this line
+		if (addrs.empty())
+			return;
+
+		std::vector<uint64_t> siblings;
+
+		for (std::vector<uint64_t>::const_iterator ait = addrs.begin();
+				ait != addrs.end();
+				++ait) {
+			if (*ait == addr)
+				continue;
+
+			kcov_debug(BP_MSG, "BP coalesced 0x%llx into 0x%llx\n",
+					(unsigned long long)*ait, (unsigned long long)addr);
+			siblings.push_back(*ait);
+		}
+
+		if (!siblings.empty())
+			m_engine.clearBreakpoints(siblings);
+
+		// Release the memory, the line won't be hit again
+		std::vector<uint64_t>().swap(addrs);
+	}
+
+	/*
+	 * Lazy arming: Only the function entry points have breakpoints from
+	 * the start, and the lines of a function are armed when it's entered.
+	 */
+	void armFunction(uint64_t addr)
+	{
+		FunctionMap_t::iterator it = m_functions.find(addr);
+
+		if (it == m_functions.end() || it->second.m_armed)
+			return;
+
+		Function &fn = it->second;
+
+		fn.m_armed = true;
+		for (std::vector<uint64_t>::const_iterator ait = fn.m_addrs.begin();
+				ait != fn.m_addrs.end();
+				++ait) {
+			// The entry itself is cleared after this hit
+			if (*ait == addr)
+				continue;
+
+			// Already covered through another address on the line
+			if (m_coalesceLines && lineIsDone(*ait))
+				continue;
+
+			m_engine.registerBreakpoint(*ait);
+		}
+
+		kcov_debug(BP_MSG, "BP lazily armed %zu breakpoints for function at 0x%llx\n",
+				fn.m_addrs.size(), (unsigned long long)addr);
+
+		std::vector<uint64_t>().swap(fn.m_addrs);
+	}
+
+	/*
+	 * Returns true if the address should be armed later, with the function
+	 * it belongs to.
+	 */
+	bool deferToFunction(uint64_t addr)
+	{
+		FunctionMap_t::iterator it = m_functions.upper_bound(addr);
+
+		if (it == m_functions.begin())
+			return false;
+		--it;
+
+		Function &fn = it->second;
+
+		if (fn.m_armed || addr >= fn.m_end)
+			return false;
+
+		fn.m_addrs.push_back(addr);
+
+		return true;
+	}
+
+	bool lineIsDone(uint64_t addr)
+	{
+		AddrToLineMap_t::const_iterator it = m_addrToLine.find(addr);
+
+		return it != m_addrToLine.end() && m_lineAddresses[it->second].empty();
+	}
+
+	void addLineAddress(const std::string &file, unsigned int lineNr, uint64_t addr)
+	{
+		if (m_addrToLine.find(addr) != m_addrToLine.end())
+			return;
+
+		std::vector<int> &lines = m_fileLines[file];
+
+		if (lineNr >= lines.size())
+			lines.resize(lineNr + 1, -1);
+
+		if (lines[lineNr] < 0) {
+			lines[lineNr] = m_lineAddresses.size();
+			m_lineAddresses.push_back(std::vector<uint64_t>());
+		}
+
+		m_lineAddresses[lines[lineNr]].push_back(addr);
+		m_addrToLine[addr] = lines[lineNr];
+	}
+
+	void reportHit(uint64_t addr)
+	{
+		for (ListenerList_t::const_iterator it = m_listeners.begin();
+				it != m_listeners.end();
+				++it)
+			(*it)->onAddressHit(addr, 1);
+	}
+
+	/*
+	 * Pipelined reporting: The tracer only queues the hit address so that
+	 * the tracee can be continued directly, and the report thread passes it
+	 * on to the listeners.
+	 */
+	void queueHit(uint64_t addr)
+	{
+		// Full, let the report thread catch up
+		while (!m_hitRing.push(addr))
+			sched_yield();
+
+		m_hitSemaphore.notify();
+	}
+
+	void startReportThread()
+	{
+		m_reportThreadShouldExit = false;
+		m_reportThreadValid = pthread_create(&m_reportThread, NULL,
+				Collector::reportThreadStatic, (void *)this) == 0;
+
+		// Report from the tracer thread instead
+		if (!m_reportThreadValid)
+			m_pipelined = false;
+	}
+
+	void stopReportThread()
+	{
+		void *rv;
+
+		if (!m_reportThreadValid)
+			return;
+
+		m_reportThreadShouldExit = true;
+		m_hitSemaphore.notify();
+		pthread_join(m_reportThread, &rv);
+
+		m_reportThreadValid = false;
+	}
+
+	void reportThread()
+	{
+		while (1) {
+			m_hitSemaphore.wait();
+
+			std::lock_guard<std::mutex> lock(m_listenerMutex);
+			unsigned int n;
+			uint64_t addr;
+
+			// Limit the batch size to keep tick() waiting for short
+			for (n = 0; n < 64 && m_hitRing.pop(addr); n++)
+				reportHit(addr);
+
+			if (n == 0 && m_reportThreadShouldExit)
+				break;
+		}
+	}
+
+	static void *reportThreadStatic(void *pThis)
+	{
+		Collector *p = (Collector *)pThis;
+
+		p->reportThread();
+
+		return NULL;
+	}
+
+
 	// From IFileParser
 	void onLine(const std::string &file, unsigned int lineNr, uint64_t addr)
 	{
@@ -174,19 +407,77 @@ private:
 			return;
 		}
 
+		for (BreakpointFilterList_t::const_iterator it = m_breakpointFilters.begin();
+				it != m_breakpointFilters.end();
+				++it) {
+			if ((*it)->skipBreakpoint(file, lineNr, addr))
+				return;
+		}
+
+		if (m_coalesceLines)
+			addLineAddress(file, lineNr, addr);
+
+		if (m_lazyArming && deferToFunction(addr))
+			return;
+
 		m_engine.registerBreakpoint(addr);
 	}
 
+	// From IFileParser::IFunctionListener
+	void onFunction(uint64_t start, uint64_t end)
+	{
+		Function &fn = m_functions[start];
+
+		// The same function can be in multiple compilation units
+		if (end > fn.m_end)
+			fn.m_end = end;
+
+		if (!fn.m_armed)
+			m_engine.registerBreakpoint(start);
+	}
+
 	typedef std::vector<ICollector::IListener *> ListenerList_t;
 	typedef std::vector<ICollector::IEventTickListener *> EventTickListenerList_t;
+	typedef std::vector<ICollector::IBreakpointFilter *> BreakpointFilterList_t;
+	class Function
+	{
+	public:
+		Function() :
+			m_end(0), m_armed(false)
+		{
+		}
+
+		uint64_t m_end;
+		bool m_armed;
+		std::vector<uint64_t> m_addrs; // Waiting to be armed
+	};
+
+	typedef std::map<uint64_t, Function> FunctionMap_t; // By entry address
+	typedef std::unordered_map<uint64_t, unsigned int> AddrToLineMap_t; // Index in m_lineAddresses
+	typedef std::unordered_map<std::string, std::vector<int>> FileLinesMap_t; // Line number -> index
 
 	IFileParser &m_fileParser;
 	IEngine &m_engine;
 	ListenerList_t m_listeners;
 	EventTickListenerList_t m_eventTickListeners;
+	BreakpointFilterList_t m_breakpointFilters;
 	int m_exitCode;
 
 	IFilter &m_filter;
+
+	bool m_pipelined;
+	bool m_coalesceLines;
+	AddrToLineMap_t m_addrToLine;
+	FileLinesMap_t m_fileLines;
+	std::vector<std::vector<uint64_t>> m_lineAddresses;
+	bool m_lazyArming;
+	FunctionMap_t m_functions;
+	SpscRing<uint64_t> m_hitRing;
+	Semaphore m_hitSemaphore;
+	std::mutex m_listenerMutex;
+	pthread_t m_reportThread;
+	bool m_reportThreadValid;
+	volatile bool m_reportThreadShouldExit;
 };
 
 ICollector &ICollector::create(IFileParser &elf, IEngine &engine, IFilter &filter)
@@ -135,6 +135,19 @@ public:
 				{"verify", no_argument, 0, 'V'},
 				{"version", no_argument, 0, 'v'},
 				{"uncommon-options", no_argument, 0, 'U'},
+				{"pipelined-reporting", no_argument, 0, 'Q'},
+				{"trap-handler", optional_argument, 0, 'H'},
+				{"uprobes", no_argument, 0, 'u'},
+				{"skip-covered", no_argument, 0, 'k'},
+				{"coalesce-lines", no_argument, 0, 'j'},
+				{"lazy-arming", no_argument, 0, 'z'},
+				{"functions-only", no_argument, 0, 'y'},
+				{"pin-cpu", no_argument, 0, 'e'},
+				{"propagate-hits", no_argument, 0, 'f'},
+				{"attach-window", required_argument, 0, 'o'},
+				{"early-detach", optional_argument, 0, 'q'},
+				{"solib-rendezvous", no_argument, 0, 'b'},
+				{"line-cache", optional_argument, 0, 'K'},
 				/*{"write-file", required_argument, 0, 'w'}, Take back when the kernel stuff works */
 				/*{"read-file", required_argument, 0, 'r'}, Ditto */
 				{0,0,0,0}
@@ -232,6 +245,66 @@ public:
 			case 'F':
 				setKey("daemonize-on-first-process-exit", 1);
 				break;
+			case 'Q':
+				setKey("pipelined-reporting", 1);
+				break;
+			case 'H':
+				setKey("trap-handler", 1);
+				if (optarg) {
+					if (std::string(optarg) != "startup")
+						return usage();
+					setKey("trap-handler-startup", 1);
+				}
+				break;
+			case 'u':
+				setKey("uprobes", 1);
+				break;
+			case 'k':
+				setKey("skip-covered", 1);
+				break;
+			case 'j':
+				setKey("coalesce-lines", 1);
+				break;
+			case 'z':
+				setKey("lazy-arming", 1);
+				break;
+			case 'y':
+				setKey("functions-only", 1);
+				break;
+			case 'e':
+				setKey("pin-cpu", 1);
+				break;
+			case 'f':
+				setKey("propagate-hits", 1);
+				break;
+			case 'o':
+				// Seconds, or a file which ends the window when it's created
+				if (isInteger(std::string(optarg)))
+					setKey("attach-window", stoul(std::string(optarg)));
+				else
+					setKey("attach-window-file", std::string(optarg));
+				break;
+			case 'q':
+				setKey("early-detach", 1);
+				if (optarg) {
+					if (!isInteger(std::string(optarg)))
+						return usage();
+					setKey("early-detach-quiet-period", stoul(std::string(optarg)));
+				}
+				break;
+			case 'b':
+				setKey("solib-rendezvous", 1);
+				break;
+			case 'K':
+				if (optarg)
+					setKey("line-cache", std::string(optarg));
+				else if (getenv("XDG_CACHE_HOME"))
+					setKey("line-cache", fmt("%s/kcov", getenv("XDG_CACHE_HOME")));
+				else if (get_home())
+					setKey("line-cache", fmt("%s/.cache/kcov", get_home()));
+				else
+					warning("--line-cache needs a directory without HOME, ignoring");
+				break;
 			case 'g':
 				setKey("gcov", 1);
 				break;
@@ -407,6 +480,27 @@ public:
 		if (printUsage)
 			return usage();
 
+		// The other engines need all breakpoints before the program starts
+		if (keyAsInt("lazy-arming") &&
+				(keyAsInt("uprobes") || keyAsInt("trap-handler") ||
+						keyAsInt("gcov") || keyAsInt("clang-sanitizer"))) {
+			warning("--lazy-arming only works with the ptrace engine, ignoring");
+			setKey("lazy-arming", 0);
+		}
+
+		if ((keyAsInt("attach-window") || keyAsString("attach-window-file") != "") &&
+				keyAsInt("attach-pid") == 0) {
+			warning("--attach-window only works together with --pid, ignoring");
+			setKey("attach-window", 0);
+			setKey("attach-window-file", "");
+		}
+
+		// The trap handler is in the preloaded library
+		if (keyAsInt("solib-rendezvous") && keyAsInt("trap-handler")) {
+			warning("--solib-rendezvous doesn't work with --trap-handler, ignoring");
+			setKey("solib-rendezvous", 0);
+		}
+
 		afterOpts = optind;
 
 		/* When tracing by PID, the filename is optional */
@@ -514,6 +608,23 @@ public:
 		setKey("command-name", "");
 		setKey("merged-name", "[merged]");
 		setKey("css-file", "");
+		setKey("pipelined-reporting", 0);
+		setKey("trap-handler", 0);
+		setKey("trap-handler-startup", 0);
+		setKey("uprobes", 0);
+		setKey("skip-covered", 0);
+		setKey("coalesce-lines", 0);
+		setKey("lazy-arming", 0);
+		setKey("functions-only", 0);
+		setKey("pin-cpu", 0);
+		setKey("propagate-hits", 0);
+		setKey("attach-window", 0);
+		setKey("attach-window-file", "");
+		setKey("early-detach", 0);
+		setKey("early-detach-quiet-period", 0);
+		setKey("solib-rendezvous", 0);
+		setKey("line-cache", "");
+		setKey("parse-threads", 0);
 	}
 
 
@@ -552,7 +663,8 @@ public:
 	void configure(const std::string &key, const std::string &value)
 	{
 		if (key == "low-limit" ||
-				key == "high-limit") {
+				key == "high-limit" ||
+				key == "parse-threads") {
 			if (!isInteger(value))
 				panic("Value for %s must be integer\n", key.c_str());
 		}
@@ -561,6 +673,8 @@ public:
 			setKey(key, stoul(std::string(value)));
 		else if (key == "high-limit")
 			setKey(key, stoul(std::string(value)));
+		else if (key == "parse-threads")
+			setKey(key, stoul(std::string(value)));
 		else if (key == "command-name")
 			setKey(key, std::string(value));
 		else if (key == "css-file")
@@ -578,7 +692,9 @@ public:
 		"                           high-limit=NUM   Percentage for high coverage\n"
 		"                           command-name=STR Name of executed command\n"
 		"                           merged-name=STR  Name of [merged] tag in HTML\n"
-		"                           css-file=FILE    Filename of bcov.css file\n";
+		"                           css-file=FILE    Filename of bcov.css file\n"
+		"                           parse-threads=NUM Threads for parsing debug info\n"
+		"                                            (default 0, all CPUs)\n";
 	}
 
 	std::string uncommonOptions()
@@ -598,6 +714,34 @@ public:
 				"                         behavior of daemons (default: wait until last)\n"
 				" --output-interval=ms    Interval to produce output in milliseconds (0 to\n"
 				"                         only output when kcov terminates, default %d)\n"
+				" --pipelined-reporting   process breakpoint hits in a separate thread and\n"
+				"                         continue the traced program directly\n"
+				" --trap-handler[=MODE]   collect breakpoint hits with a signal handler in the\n"
+				"                         traced program instead of ptrace (x86 only). With\n"
+				"                         MODE=startup, the breakpoints are set when the\n"
+				"                         program starts, without any tracer (x86_64 only)\n"
+				" --uprobes               collect breakpoint hits with kernel uprobes instead\n"
+				"                         of ptrace (needs perf_event_open permissions)\n"
+				" --skip-covered          don't set breakpoints on addresses which are already\n"
+				"                         covered in the output directory from earlier runs\n"
+				" --coalesce-lines        remove the breakpoints on all addresses of a line\n"
+				"                         when the first one is hit (line coverage only)\n"
+				" --lazy-arming           only set breakpoints on function entries at start,\n"
+				"                         and on the lines of a function when it's entered\n"
+				" --functions-only        only collect function coverage, i.e., one line (the\n"
+				"                         entry) per function\n"
+				" --pin-cpu               run kcov and the traced processes on one CPU, as\n"
+				"                         older kcov versions did\n"
+				" --propagate-hits        remove a breakpoint from all traced processes when\n"
+				"                         it's hit in one of them (e.g., forked workers)\n"
+				" --attach-window=X       with --pid: collect for X seconds, or until the file\n"
+				"                         X is created, then detach and leave the program running\n"
+				" --early-detach[=MS]     detach when all breakpoints have been hit (and none\n"
+				"                         have been added for MS milliseconds)\n"
+				" --solib-rendezvous      find shared libraries through the dynamic linker\n"
+				"                         instead of a preloaded library\n"
+				" --line-cache[=DIR]      cache the line information of binaries in DIR\n"
+				"                         (default ~/.cache/kcov), keyed by their build-id\n"
 				"\n"
 				" --debug=X               set kcov debugging level (max 31, default 0)\n"
 				"\n"
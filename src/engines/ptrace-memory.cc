@@ -0,0 +1,202 @@
+#include "ptrace-memory.hh"
+
+#include <utils.hh>
+
+#include <sys/types.h>
+#include <sys/ptrace.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <errno.h>
+
+using namespace kcov;
+
+#ifndef IOV_MAX
+# define IOV_MAX 1024
+#endif
+
+static unsigned long getAligned(unsigned long addr)
+{
+	return (addr / sizeof(unsigned long)) * sizeof(unsigned long);
+}
+
+PtraceMemory::PtraceMemory() :
+		m_hasVmReadv(true)
+{
+}
+
+PtraceMemory::~PtraceMemory()
+{
+	for (MemFdMap_t::iterator it = m_memFds.begin();
+			it != m_memFds.end();
+			++it) {
+		if (it->second >= 0)
+			close(it->second);
+	}
+}
+
+bool PtraceMemory::read(pid_t pid, const RangeList_t &ranges)
+{
+	bool out = true;
+
+	for (size_t first = 0; first < ranges.size(); first += IOV_MAX) {
+		size_t n = ranges.size() - first;
+		struct iovec local[IOV_MAX];
+		struct iovec remote[IOV_MAX];
+		ssize_t total = 0;
+		ssize_t rv = -1;
+
+		if (n > IOV_MAX)
+			n = IOV_MAX;
+
+		for (size_t i = 0; i < n; i++) {
+			const Range &cur = ranges[first + i];
+
+			local[i].iov_base = cur.m_data;
+			local[i].iov_len = cur.m_size;
+			remote[i].iov_base = (void *)cur.m_addr;
+			remote[i].iov_len = cur.m_size;
+			total += cur.m_size;
+		}
+
+		if (m_hasVmReadv) {
+			rv = process_vm_readv(pid, local, n, remote, n, 0);
+
+			// Not implemented or not allowed, don't try again
+			if (rv < 0 && (errno == ENOSYS || errno == EPERM))
+				m_hasVmReadv = false;
+		}
+
+		if (rv == total)
+			continue;
+
+		kcov_debug(ENGINE_MSG, "PT bulk read failed for %d (%zd of %zd bytes), falling back\n",
+				pid, rv, total);
+
+		// Partial read, redo this batch range by range
+		for (size_t i = 0; i < n; i++) {
+			const Range &cur = ranges[first + i];
+			int fd = getMemFd(pid);
+
+			if (fd >= 0 && pread(fd, cur.m_data, cur.m_size, cur.m_addr) == (ssize_t)cur.m_size)
+				continue;
+
+			readWords(pid, cur);
+			out = false;
+		}
+	}
+
+	return out;
+}
+
+bool PtraceMemory::write(pid_t pid, const RangeList_t &ranges)
+{
+	bool out = true;
+
+	for (RangeList_t::const_iterator it = ranges.begin();
+			it != ranges.end();
+			++it) {
+		if (writeRange(pid, *it))
+			continue;
+
+		writeWords(pid, *it);
+		out = false;
+	}
+
+	return out;
+}
+
+unsigned long PtraceMemory::peekWord(pid_t pid, unsigned long addr)
+{
+	return ptrace((__ptrace_request)PTRACE_PEEKTEXT, pid, getAligned(addr), 0);
+}
+
+void PtraceMemory::pokeWord(pid_t pid, unsigned long addr, unsigned long val)
+{
+	ptrace((__ptrace_request)PTRACE_POKETEXT, pid, getAligned(addr), val);
+}
+
+void PtraceMemory::forget(pid_t pid)
+{
+	MemFdMap_t::iterator it = m_memFds.find(pid);
+
+	if (it == m_memFds.end())
+		return;
+
+	if (it->second >= 0)
+		close(it->second);
+
+	m_memFds.erase(it);
+}
+
+int PtraceMemory::getMemFd(pid_t pid)
+{
+	MemFdMap_t::iterator it = m_memFds.find(pid);
+
+	if (it != m_memFds.end() && it->second >= 0)
+		return it->second;
+
+	int fd = ::open(fmt("/proc/%d/mem", pid).c_str(), O_RDWR);
+
+	m_memFds[pid] = fd;
+
+	return fd;
+}
+
+bool PtraceMemory::writeRange(pid_t pid, const Range &range)
+{
+	// Retry once with a fresh fd, the old one is stale after an exec
+	for (unsigned int attempt = 0; attempt < 2; attempt++) {
+		int fd = getMemFd(pid);
+
+		if (fd < 0)
+			return false;
+
+		if (pwrite(fd, range.m_data, range.m_size, range.m_addr) == (ssize_t)range.m_size)
+			return true;
+
+		forget(pid);
+	}
+
+	kcov_debug(ENGINE_MSG, "PT bulk write failed for %d at 0x%lx, falling back\n",
+			pid, range.m_addr);
+
+	return false;
+}
+
+void PtraceMemory::readWords(pid_t pid, const Range &range)
+{
+	unsigned long end = range.m_addr + range.m_size;
+
+	for (unsigned long addr = getAligned(range.m_addr); addr < end; addr += sizeof(unsigned long)) {
+		unsigned long val = peekWord(pid, addr);
+		uint8_t *p = (uint8_t *)&val;
+
+		for (unsigned int i = 0; i < sizeof(val); i++) {
+			if (addr + i >= range.m_addr && addr + i < end)
+				range.m_data[addr + i - range.m_addr] = p[i];
+		}
+	}
+}
+
+void PtraceMemory::writeWords(pid_t pid, const Range &range)
+{
+	unsigned long end = range.m_addr + range.m_size;
+
+	for (unsigned long addr = getAligned(range.m_addr); addr < end; addr += sizeof(unsigned long)) {
+		unsigned long val;
+		uint8_t *p = (uint8_t *)&val;
+
+		// Partial word, keep the bytes outside of the range
+		if (addr < range.m_addr || addr + sizeof(val) > end)
+			val = peekWord(pid, addr);
+
+		for (unsigned int i = 0; i < sizeof(val); i++) {
+			if (addr + i >= range.m_addr && addr + i < end)
+				p[i] = range.m_data[addr + i - range.m_addr];
+		}
+
+		pokeWord(pid, addr, val);
+	}
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include <vector>
+#include <unordered_map>
+
+namespace kcov
+{
+	/**
+	 * Bulk access to the memory of a traced process.
+	 *
+	 * Reads are done with process_vm_readv and writes through /proc/PID/mem,
+	 * which both allow many ranges to be handled with a single system call.
+	 * PTRACE_PEEKTEXT/PTRACE_POKETEXT is used as a fallback if these are
+	 * not available.
+	 */
+	class PtraceMemory
+	{
+	public:
+		/**
+		 * A range of tracee memory and the local buffer for it
+		 */
+		class Range
+		{
+		public:
+			Range(unsigned long addr, size_t size, uint8_t *data) :
+				m_addr(addr), m_size(size), m_data(data)
+			{
+			}
+
+			unsigned long m_addr;
+			size_t m_size;
+			uint8_t *m_data;
+		};
+		typedef std::vector<Range> RangeList_t;
+
+		PtraceMemory();
+
+		~PtraceMemory();
+
+		/**
+		 * Read a list of ranges from the tracee.
+		 *
+		 * @param pid the process to read from
+		 * @param ranges the ranges to read, data is stored in the range buffers
+		 *
+		 * @return true if all ranges could be read without falling back to ptrace
+		 */
+		bool read(pid_t pid, const RangeList_t &ranges);
+
+		/**
+		 * Write a list of ranges to the tracee (also to read-only text).
+		 *
+		 * @param pid the process to write to
+		 * @param ranges the ranges to write
+		 *
+		 * @return true if all ranges could be written without falling back to ptrace
+		 */
+		bool write(pid_t pid, const RangeList_t &ranges);
+
+		unsigned long peekWord(pid_t pid, unsigned long addr);
+
+		void pokeWord(pid_t pid, unsigned long addr, unsigned long val);
+
+		/**
+		 * Forget cached state for a process, e.g., when it exits or execs.
+		 *
+		 * @param pid the process
+		 */
+		void forget(pid_t pid);
+
+	private:
+		int getMemFd(pid_t pid);
+
+		void readWords(pid_t pid, const Range &range);
+
+		void writeWords(pid_t pid, const Range &range);
+
+		bool writeRange(pid_t pid, const Range &range);
+
+		typedef std::unordered_map<pid_t, int> MemFdMap_t;
+
+		MemFdMap_t m_memFds; // /proc/PID/mem per process
+		bool m_hasVmReadv;
+	};
+}
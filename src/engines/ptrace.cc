@@ -5,6 +5,11 @@
 #include <solib-handler.hh>
 #include <file-parser.hh>
 #include <phdr_data.h>
+#include <trap_data.h>
+#include <shadow-text.hh>
+
+#include "ptrace-memory.hh"
+#include "rendezvous.hh"
 
 #include <unistd.h>
 #include <sys/personality.h>
@@ -13,15 +18,20 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
 #include <libelf.h>
 #include <signal.h>
 #include <fcntl.h>
 #include <sched.h>
 #include <sys/types.h>
 #include <dirent.h>
+#include <pthread.h>
 
+#include <algorithm>
+#include <atomic>
 #include <map>
 #include <unordered_map>
+#include <unordered_set>
 #include <list>
 #include <mutex>
 #include <vector>
@@ -36,6 +46,8 @@ enum
 	i386_EIP = 12,
 	x86_64_RIP = 16,
 	ppc_NIP = 32,
+	ppc_LNK = 36,
+	arm_LR = 14,
 	arm_PC = 15,
 };
 
@@ -44,39 +56,61 @@ static unsigned long getAligned(unsigned long addr)
 	return (addr / sizeof(unsigned long)) * sizeof(unsigned long);
 }
 
-static unsigned long arch_getPcFromRegs(unsigned long *regs)
+// Offset of the PC in the user area, for PTRACE_PEEKUSER/PTRACE_POKEUSER
+static unsigned long arch_pcOffset(void)
 {
 	unsigned long out;
 
 #if defined(__i386__)
-	out = regs[i386_EIP] - 1;
+	out = i386_EIP;
 #elif defined(__x86_64__)
-	out = regs[x86_64_RIP] - 1;
+	out = x86_64_RIP;
 #elif defined(__arm__)
-	out = regs[arm_PC];
+	out = arm_PC;
 #elif defined(__powerpc__)
-	out = regs[ppc_NIP];
+	out = ppc_NIP;
 #else
 # error Unsupported architecture
 #endif
 
-	return out;
+	return out * sizeof(unsigned long);
 }
 
-static void arch_adjustPcAfterBreakpoint(unsigned long *regs)
+// The breakpoint address when stopped on a breakpoint at pc
+static unsigned long arch_getBreakpointAddress(unsigned long pc)
 {
-#if defined(__i386__)
-	regs[i386_EIP]--;
-#elif defined(__x86_64__)
-	regs[x86_64_RIP]--;
+	unsigned long out;
+
+#if defined(__i386__) || defined(__x86_64__)
+	out = pc - 1;
 #elif defined(__powerpc__) || defined(__arm__)
-	// Do nothing
+	out = pc;
 #else
 # error Unsupported architecture
 #endif
+
+	return out;
 }
 
 
+// Size of the trap instruction at insn (4 bytes), or 0 if it's something else
+static unsigned int arch_trapSize(const uint8_t *insn)
+{
+	uint32_t word;
+
+	memcpy(&word, insn, sizeof(word));
+
+#if defined(__i386__) || defined(__x86_64__)
+	return insn[0] == 0xcc ? 1 : 0;
+#elif defined(__powerpc__)
+	return word == 0x7fe00008 ? 4 : 0;
+#elif defined(__arm__)
+	return word == 0xfedeffe7 ? 4 : 0;
+#else
+# error Unsupported architecture
+#endif
+}
+
 static unsigned long arch_setupBreakpoint(unsigned long addr, unsigned long old_data)
 {
 	unsigned long val;
@@ -128,6 +162,10 @@ static int get_current_cpu(void)
 
 static void tie_process_to_cpu(pid_t pid, int cpu)
 {
+	// Not pinned (--pin-cpu)
+	if (cpu < 0)
+		return;
+
 	// Switching CPU while running will cause icache
 	// conflicts. So let's just forbid that.
 
@@ -234,6 +272,11 @@ static int kill_lwp (unsigned long lwpid, int signo)
 	return kill (lwpid, signo);
 }
 
+// Only interrupts waitpid() in the tracer when the attach window has ended
+static void windowSignalHandler(int sig)
+{
+}
+
 class Ptrace : public IEngine
 {
 public:
@@ -242,16 +285,53 @@ public:
 		m_activeChild(0),
 		m_child(0),
 		m_firstChild(0),
-		m_parentCpu(0),
+		m_parentCpu(-1),
 		m_listener(NULL),
-		m_signal(0)
+		m_pageSize(getpagesize()),
+		m_rendezvous(m_memory),
+		m_useRendezvous(false),
+		m_rendezvousAddr(0),
+		m_rendezvousData(0),
+		m_relocationQueued(false),
+		m_trapMode(false),
+		m_trapHandoverPending(false),
+		m_trapDetachPending(false),
+		m_detached(false),
+		m_trapData(NULL),
+		m_trapDataSize(0),
+		m_propagateHits(false),
+		m_trackExec(false),
+		m_seized(false),
+		m_attached(false),
+		m_earlyDetach(false),
+		m_quietPeriod(0),
+		m_doneSince(0),
+		m_attachStart(0),
+		m_attachDone(0),
+		m_windowEnd(0),
+		m_windowThreadValid(false),
+		m_windowEnded(false),
+		m_windowDone(false)
 	{
 	}
 
 	~Ptrace()
 	{
+		if (m_windowThreadValid) {
+			void *rv;
+
+			m_windowDone = true;
+			pthread_join(m_windowThread, &rv);
+		}
+
 		kill(SIGTERM);
-		ptrace(PTRACE_DETACH, m_activeChild, 0, 0);
+		if (!m_detached)
+			ptrace(PTRACE_DETACH, m_activeChild, 0, 0);
+
+		if (m_trapData)
+			munmap(m_trapData, m_trapDataSize);
+		if (m_trapPath != "")
+			unlink(m_trapPath.c_str());
 	}
 
 
@@ -260,10 +340,24 @@ public:
 	{
 		m_listener = &listener;
 
-		m_parentCpu = get_current_cpu();
-		tie_process_to_cpu(getpid(), m_parentCpu);
+		/*
+		 * Breakpoints are one-shot, so the traced processes mostly run
+		 * without stopping, and can use all CPUs. Writes to the program
+		 * text through the kernel keep the instruction caches coherent.
+		 */
+		if (IConfiguration::getInstance().keyAsInt("pin-cpu")) {
+			m_parentCpu = get_current_cpu();
+			tie_process_to_cpu(getpid(), m_parentCpu);
+		}
 
 		m_instructionMap.clear();
+		m_propagateHits = IConfiguration::getInstance().keyAsInt("propagate-hits");
+		m_earlyDetach = IConfiguration::getInstance().keyAsInt("early-detach");
+		m_quietPeriod = IConfiguration::getInstance().keyAsInt("early-detach-quiet-period");
+		m_useRendezvous = IConfiguration::getInstance().keyAsInt("solib-rendezvous") &&
+				IConfiguration::getInstance().keyAsInt("parse-solibs");
+		m_trackExec = m_propagateHits || IConfiguration::getInstance().keyAsInt("attach-window") ||
+				IConfiguration::getInstance().keyAsString("attach-window-file") != "";
 
 		/* Basic check first */
 		if (access(executable.c_str(), X_OK) != 0)
@@ -272,11 +366,20 @@ public:
 		unsigned int pid = IConfiguration::getInstance().keyAsInt("attach-pid");
 		bool res = false;
 
+		if (pid == 0)
+			setupTrapMode();
+
 		if (pid != 0)
 			res = attachPid(pid);
 		else
 			res = forkChild(executable.c_str());
 
+		if (res && pid != 0)
+			setupAttachWindow();
+
+		if (res)
+			queueMainRelocation(executable);
+
 		return res;
 	}
 
@@ -285,17 +388,22 @@ public:
 		if (addr == 0)
 			return -1;
 
-		unsigned long data;
-
 		// There already?
 		if (m_instructionMap.find(addr) != m_instructionMap.end())
 			return 0;
 
-		data = peekWord(addr);
-
-		m_instructionMap[addr] = data;
+		// The original instruction is filled in when the breakpoint is armed
+		m_instructionMap[addr] = 0;
 		m_pendingBreakpoints.push_back(addr);
 
+		/*
+		 * Armed in the process it's registered for: The one which loaded
+		 * the solib being parsed, or the one whose stop is being handled.
+		 */
+		pid_t owner = getSolibOwner();
+
+		m_breakpointOwners[addr] = owner != 0 ? owner : m_activeChild;
+
 		kcov_debug(BP_MSG, "BP registered at 0x%lx\n", addr);
 
 		return 0;
@@ -306,9 +414,6 @@ public:
 		if (m_instructionMap.find(addr) == m_instructionMap.end()) {
 			kcov_debug(BP_MSG, "Can't find breakpoint at 0x%lx\n", addr);
 
-			// Stupid workaround for avoiding the solib thread race
-			msleep(1);
-
 			return false;
 		}
 
@@ -317,38 +422,70 @@ public:
 		val = arch_clearBreakpoint(addr, val, peekWord(addr));
 
 		pokeWord(addr, val);
+		m_armed.erase(addr);
 
 		return true;
 	}
 
-	void singleStep()
+	void clearBreakpoints(const std::vector<uint64_t> &addrs)
 	{
-		unsigned long regs[1024];
+		std::vector<unsigned long> armed;
+
+		// Not possible to write to the process when detached
+		if (m_detached)
+			return;
+
+		for (std::vector<uint64_t>::const_iterator it = addrs.begin();
+				it != addrs.end();
+				++it) {
+			unsigned long addr = *it;
+			PendingBreakpointList_t::iterator pit = std::find(m_pendingBreakpoints.begin(),
+					m_pendingBreakpoints.end(), addr);
+
+			// Not armed yet, just drop it
+			if (pit != m_pendingBreakpoints.end()) {
+				m_pendingBreakpoints.erase(pit);
+				m_breakpointOwners.erase(addr);
+				m_instructionMap.erase(addr);
+				continue;
+			}
 
-		ptrace((__ptrace_request)PTRACE_GETREGS, m_activeChild, 0, &regs);
+			// Kept in the instruction map, another thread might already be stopped on it
+			if (m_instructionMap.find(addr) != m_instructionMap.end())
+				armed.push_back(addr);
+		}
 
-		// Step back one instruction
-		arch_adjustPcAfterBreakpoint(regs);
-		ptrace((__ptrace_request)PTRACE_SETREGS, m_activeChild, 0, &regs);
+		if (armed.empty())
+			return;
+
+		patchBreakpoints(m_activeChild, armed, false);
+		for (std::vector<unsigned long>::iterator it = armed.begin();
+				it != armed.end();
+				++it)
+			m_armed.erase(*it);
+
+		if (m_propagateHits)
+			m_hitAddrs.insert(m_hitAddrs.end(), armed.begin(), armed.end());
 	}
 
-	const Event waitEvent()
+	// Step back to the breakpoint address
+	void singleStep(unsigned long addr)
+	{
+		ptrace((__ptrace_request)PTRACE_POKEUSER, m_activeChild, arch_pcOffset(), addr);
+	}
+
+	const Event handleStop(pid_t who, int status)
 	{
 		static uint64_t lastSignalAddress;
 		Event out;
-		int status;
-		int who;
 
 		// Assume error
 		out.type = ev_error;
 		out.data = -1;
 
-		who = waitpid(-1, &status, __WALL);
-		if (who == -1) {
-			kcov_debug(ENGINE_MSG, "Returning error\n");
-			return out;
-		}
-
+		// The first stop of a new thread or process
+		if (m_children.find(who) == m_children.end())
+			m_newTasks.erase(who);
 		m_children[who] = 1;
 
 		m_activeChild = who;
@@ -373,29 +510,83 @@ public:
 				kcov_debug(ENGINE_MSG, "PT clone at 0x%llx for %d\n",
 						(unsigned long long)out.addr, m_activeChild);
 				out.data = 0;
-			} else if (sig == SIGTRAP || sig == SIGSTOP || sig == sigill) {
+
+				unsigned long pid;
+
+				if (ptrace(PTRACE_GETEVENTMSG, m_activeChild, 0, &pid) == 0) {
+					// A new process with a copy of the breakpoints
+					if ((status >> 16) != PTRACE_EVENT_CLONE)
+						m_processes.insert((pid_t)pid);
+
+					// Until its first stop, which can come before this
+					if (m_children.find((pid_t)pid) == m_children.end())
+						m_newTasks.insert((pid_t)pid);
+				}
+			} else if ((status >> 16) == PTRACE_EVENT_STOP) {
+				// Seized threads: New threads, PTRACE_INTERRUPT and group-stops
+				out.data = 0;
+			} else if ((sig == SIGTRAP) && (status >> 16) == PTRACE_EVENT_EXEC) {
+				// Another program, which has none of our breakpoints
+				kcov_debug(ENGINE_MSG, "PT exec for %d\n", m_activeChild);
+				out.data = 0;
+
+				m_processes.erase(who);
+				m_memory.forget(who);
+			} else if ((sig == SIGTRAP && isBreakpointTrap()) || sig == sigill) {
 				// A trap?
-						out.type = ev_breakpoint;
-						out.data = -1;
+				out.type = ev_breakpoint;
+				out.data = -1;
 
-						kcov_debug(ENGINE_MSG, "PT BP at 0x%llx:%d for %d\n",
-								(unsigned long long)out.addr, out.data, m_activeChild);
+				kcov_debug(ENGINE_MSG, "PT BP at 0x%llx:%d for %d\n",
+						(unsigned long long)out.addr, out.data, m_activeChild);
 
-						bool insnFound = m_instructionMap.find(out.addr) != m_instructionMap.end();
+				// The dynamic linker has loaded or unloaded something
+				if (m_rendezvousAddr != 0 && out.addr == m_rendezvousAddr) {
+					queueRendezvous(who);
+					returnFromFunction(who);
 
-						// Single-step if we have this BP
-						if (insnFound)
-							singleStep();
-						else if (sig != SIGSTOP)
-							skipInstruction();
+					out.type = ev_signal;
+					out.data = 0;
 
-						// Wait for solib data if this is the first time
-						if (m_firstBreakpoint && insnFound) {
-							blockUntilSolibDataRead();
-							m_firstBreakpoint = false;
-						}
+					return out;
+				}
 
-						return out;
+				/*
+				 * Breakpoints are one-shot, and the address stays in the map when
+				 * the instruction has been restored. Other threads which have
+				 * stopped on the same breakpoint are therefore also stepped back.
+				 */
+				if (m_instructionMap.find(out.addr) != m_instructionMap.end()) {
+					singleStep(out.addr);
+
+					return out;
+				}
+
+				skipInstruction();
+
+				/*
+				 * Not ours, so normally forced by the preloaded library, which
+				 * has written the solib data before the trap.
+				 */
+				readSolibData();
+
+				/*
+				 * The first forced trap from the preloaded library: Write
+				 * the table for its SIGTRAP handler when the solibs have
+				 * been parsed and everything is armed. The next one after
+				 * it has installed the handler is where we detach.
+				 */
+				if (m_trapMode && sig == SIGTRAP && m_firstBreakpoint) {
+					m_firstBreakpoint = false;
+					m_trapHandoverPending = true;
+				} else if (m_trapData && m_trapData->ready && who == m_trapData->pid) {
+					m_trapDetachPending = true;
+				}
+
+				return out;
+			} else if (sig == SIGTRAP || sig == SIGSTOP) {
+				// exec, new threads/processes and attach: Not for the program
+				out.data = 0;
 			}
 
 			kcov_debug(ENGINE_MSG, "PT signal %d at 0x%llx for %d\n",
@@ -412,6 +603,8 @@ public:
 			kcov_debug(ENGINE_MSG, "PT terminating signal %d at 0x%llx for %d\n",
 					sig, (unsigned long long)out.addr, m_activeChild);
 			m_children.erase(who);
+			m_processes.erase(who);
+			m_memory.forget(who);
 
 			if (!childrenLeft())
 				out.type = ev_signal_exit;
@@ -423,6 +616,8 @@ public:
 					exitStatus, (unsigned long long)out.addr, m_activeChild, m_activeChild == m_firstChild ? " (first child)" : "");
 
 			m_children.erase(who);
+			m_processes.erase(who);
+			m_memory.forget(who);
 
 			if (who == m_firstChild)
 				out.type = ev_exit_first_process;
@@ -443,33 +638,107 @@ public:
 
 
 	/**
-	 * Continue execution with an event
+	 * Continue execution, and handle all stops which are pending
 	 */
 	bool continueExecution()
 	{
-		int res;
+		if (m_detached)
+			return continueDetached();
+
+		if (m_windowEnded)
+			return endAttachWindow();
+
+		// --early-detach: Nothing left to hit, and quiet for long enough?
+		if (m_earlyDetach && breakpointsDone()) {
+			uint64_t now = get_ms_timestamp();
+
+			if (m_doneSince == 0)
+				m_doneSince = now;
+			if (now - m_doneSince >= m_quietPeriod)
+				return detachWhenDone();
+		} else {
+			m_doneSince = 0;
+		}
+
+		// Let the main file be parsed on the tick, before any code runs
+		if (m_relocationQueued) {
+			m_relocationQueued = false;
+
+			return true;
+		}
 
 		setupAllBreakpoints();
 
-		kcov_debug(ENGINE_MSG, "PT continuing %d with signal %lu\n", m_activeChild, m_signal);
-		res = ptrace(PTRACE_CONT, m_activeChild, 0, m_signal);
-		if (res < 0) {
-			kcov_debug(ENGINE_MSG, "PT error for %d: %d\n", m_activeChild, res);
-			m_children.erase(m_activeChild);
+		if (m_trapHandoverPending) {
+			m_trapHandoverPending = false;
+
+			writeTrapTable();
 		}
 
+		if (m_trapDetachPending) {
+			m_trapDetachPending = false;
 
-		Event ev = waitEvent();
-		m_signal = ev.type == ev_signal ? ev.data : 0;
+			detachToTrapHandler();
+			m_stopped.clear();
 
-		if (m_listener)
-			m_listener->onEvent(ev);
+			return true;
+		}
 
-		if (ev.type == ev_breakpoint)
-			clearBreakpoint(ev.addr);
+		resumeStopped();
 
-		if (ev.type == ev_error)
-			return false;
+		if (m_attachStart != 0)
+			reportAttach();
+
+		/*
+		 * Wait for the first stop, then pick up the ones which are already
+		 * pending. Poll during the --early-detach quiet period.
+		 */
+		int flags = __WALL | (m_doneSince != 0 ? WNOHANG : 0);
+		unsigned int n;
+
+		for (n = 0; ; n++) {
+			int status;
+			pid_t who = waitpid(-1, &status, flags);
+
+			if (who == 0) {
+				if (n == 0)
+					msleep(10);
+				break;
+			}
+
+			if (who < 0) {
+				// No more pending stops
+				if (n != 0)
+					break;
+
+				if (errno == EINTR && m_windowEnded)
+					return endAttachWindow();
+
+				kcov_debug(ENGINE_MSG, "Returning error\n");
+				if (m_listener)
+					m_listener->onEvent(Event(ev_error, -1));
+
+				return false;
+			}
+			flags |= WNOHANG;
+
+			Event ev = handleStop(who, status);
+
+			if (WIFSTOPPED(status))
+				m_stopped.push_back(StoppedChild(who, ev.type == ev_signal ? ev.data : 0));
+
+			if (m_listener)
+				m_listener->onEvent(ev);
+
+			if (ev.type == ev_breakpoint && clearBreakpoint(ev.addr) && m_propagateHits)
+				m_hitAddrs.push_back(ev.addr);
+		}
+
+		propagateHits();
+
+		// For kill() and the trap handler handover
+		if (!m_stopped.empty())
+			m_activeChild = m_stopped.back().m_pid;
 
 		return true;
 	}
@@ -483,19 +752,357 @@ public:
 
 private:
 
+	void setupTrapMode()
+	{
+		if (!IConfiguration::getInstance().keyAsInt("trap-handler"))
+			return;
+
+#if defined(__i386__) || defined(__x86_64__)
+		m_trapPath = IOutputHandler::getInstance().getOutDirectory() + "kcov-trap.data";
+		unlink(m_trapPath.c_str());
+
+		// Inherited by the child, read by the preloaded library
+		setenv("KCOV_TRAP_PATH", m_trapPath.c_str(), 1);
+		m_trapMode = true;
+#else
+		warning("kcov: --trap-handler is only supported on x86, using ptrace\n");
+#endif
+	}
+
+	/*
+	 * Write the breakpoint table for the SIGTRAP handler in the preloaded
+	 * library, which then installs the handler while still traced.
+	 */
+	void writeTrapTable()
+	{
+		if (m_children.size() != 1) {
+			kcov_debug(ENGINE_MSG, "PT multiple processes, not using the trap handler\n");
+			return;
+		}
+
+		m_trapAddrs.clear();
+		for (instructionMap_t::const_iterator it = m_instructionMap.begin();
+				it != m_instructionMap.end();
+				++it)
+			m_trapAddrs.push_back(it->first);
+		std::sort(m_trapAddrs.begin(), m_trapAddrs.end());
+
+		// Already there if the preloaded library can't write to the text
+		int fd = ::open(m_trapPath.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+		if (fd < 0 && errno == EEXIST) {
+			warning("kcov: The program text can't be made writable (W^X?), using ptrace\n");
+			m_trapMode = false;
+			return;
+		} else if (fd < 0) {
+			warning("kcov: Can't create %s, using ptrace\n", m_trapPath.c_str());
+			return;
+		}
+
+		m_trapDataSize = trap_data_size(m_trapAddrs.size());
+		if (ftruncate(fd, m_trapDataSize) < 0) {
+			close(fd);
+			return;
+		}
+
+		void *p = mmap(NULL, m_trapDataSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (p == MAP_FAILED)
+			return;
+
+		m_trapData = (struct trap_data *)p;
+		m_trapData->magic = KCOV_TRAP_MAGIC;
+		m_trapData->version = KCOV_TRAP_VERSION;
+		m_trapData->pid = m_activeChild;
+		m_trapData->n_entries = m_trapAddrs.size();
+
+		for (size_t i = 0; i < m_trapAddrs.size(); i++) {
+			unsigned long addr = m_trapAddrs[i];
+			unsigned long shift = 8 * (addr - getAligned(addr));
+
+			m_trapData->entries[i].addr = addr;
+			m_trapData->entries[i].orig_byte = (m_instructionMap[addr] >> shift) & 0xffUL;
+			m_trapData->entries[i].bit = i;
+		}
+		m_trapReported.assign(trap_data_bitmap_words(m_trapAddrs.size()), 0);
+
+		kcov_debug(ENGINE_MSG, "PT wrote %zu breakpoints for the trap handler in %d\n",
+				m_trapAddrs.size(), m_activeChild);
+	}
+
+	/*
+	 * The handler is installed: Detach, and read the hits from the shared
+	 * bitmap from now on. The breakpoints hit since the table was written
+	 * are already restored, so the handler never sees them.
+	 */
+	void detachToTrapHandler()
+	{
+		kcov_debug(ENGINE_MSG, "PT handing over to the trap handler in %d\n", m_activeChild);
+
+		unsigned long signal = 0;
+
+		for (StoppedList_t::const_iterator it = m_stopped.begin();
+				it != m_stopped.end();
+				++it) {
+			if (it->m_pid == m_activeChild)
+				signal = it->m_signal;
+		}
+
+		ptrace(PTRACE_DETACH, m_activeChild, 0, signal);
+		m_detached = true;
+	}
+
+	bool continueDetached()
+	{
+		int status;
+		pid_t who = waitpid(m_firstChild, &status, WNOHANG);
+
+		// Read after the wait, so that hits just before the exit are included
+		if (m_trapData)
+			reportTrapHits();
+
+		if (who == 0) {
+			msleep(10);
+
+			return true;
+		}
+
+		Event ev(ev_error, -1);
+
+		if (who > 0 && WIFEXITED(status))
+			ev = Event(ev_exit_first_process, WEXITSTATUS(status));
+		else if (who > 0 && WIFSIGNALED(status))
+			ev = Event(ev_signal_exit, WTERMSIG(status));
+
+		if (m_listener)
+			m_listener->onEvent(ev);
+
+		m_activeChild = 0;
+
+		return false;
+	}
+
+	void reportTrapHits()
+	{
+		uint32_t *bitmap = trap_data_bitmap(m_trapData);
+
+		for (size_t i = 0; i < m_trapReported.size(); i++) {
+			uint32_t cur = bitmap[i] & ~m_trapReported[i];
+
+			if (cur == 0)
+				continue;
+
+			m_trapReported[i] |= cur;
+			for (unsigned int bit = 0; bit < 32; bit++) {
+				if (!(cur & (1U << bit)))
+					continue;
+
+				if (m_listener)
+					m_listener->onEvent(Event(ev_breakpoint, -1, m_trapAddrs[i * 32 + bit]));
+			}
+		}
+	}
+
+	/*
+	 * Arm all pending breakpoints, each in the process it was registered
+	 * for. After a batch of stops, that's not necessarily the last one.
+	 */
 	void setupAllBreakpoints()
 	{
-		for (PendingBreakpointList_t::const_iterator addrIt = m_pendingBreakpoints.begin();
-				addrIt != m_pendingBreakpoints.end();
-				++addrIt) {
-			unsigned long addr = *addrIt;
-			unsigned long cur_data = peekWord(addr);
+		if (m_pendingBreakpoints.empty())
+			return;
+
+		std::unordered_map<pid_t, std::vector<unsigned long> > byProcess;
+
+		for (PendingBreakpointList_t::const_iterator it = m_pendingBreakpoints.begin();
+				it != m_pendingBreakpoints.end();
+				++it) {
+			BreakpointOwnerMap_t::const_iterator owner = m_breakpointOwners.find(*it);
+			pid_t pid = m_firstChild;
+
+			// Registered before the first child was there
+			if (owner != m_breakpointOwners.end() && owner->second != 0)
+				pid = owner->second;
+
+			byProcess[pid].push_back(*it);
+		}
+
+		for (std::unordered_map<pid_t, std::vector<unsigned long> >::iterator it = byProcess.begin();
+				it != byProcess.end();
+				++it) {
+			pid_t pid = it->first;
+			std::vector<unsigned long> &addrs = it->second;
+
+			// Exited, so there is nothing to arm them in
+			if (pid != m_firstChild && m_children.find(pid) == m_children.end()) {
+				kcov_debug(BP_MSG, "BP %d is gone, dropping %zu breakpoints\n", pid, addrs.size());
+
+				for (std::vector<unsigned long>::const_iterator ait = addrs.begin();
+						ait != addrs.end();
+						++ait)
+					m_instructionMap.erase(*ait);
+				continue;
+			}
 
-			// Set the breakpoint
-			pokeWord(addr,	arch_setupBreakpoint(addr, cur_data));
+			patchBreakpoints(pid, addrs, true);
+			if (m_earlyDetach)
+				m_armed.insert(addrs.begin(), addrs.end());
 		}
 
 		m_pendingBreakpoints.clear();
+		m_breakpointOwners.clear();
+	}
+
+	/*
+	 * Arm or disarm breakpoints. The breakpoints are grouped by page, and
+	 * each page is taken from the shadow text (or read once if not available),
+	 * patched locally and then written back with one write per run of
+	 * consecutive pages.
+	 */
+	void patchBreakpoints(pid_t pid, std::vector<unsigned long> &addrs, bool arm)
+	{
+		std::sort(addrs.begin(), addrs.end());
+
+		PtraceMemory::RangeList_t pages;
+		std::vector<size_t> firstInPage;
+		unsigned long lastPage = 0;
+
+		for (size_t i = 0; i < addrs.size(); i++) {
+			unsigned long page = getPage(addrs[i]);
+
+			if (i != 0 && page == lastPage)
+				continue;
+
+			pages.push_back(PtraceMemory::Range(page, m_pageSize, NULL));
+			firstInPage.push_back(i);
+			lastPage = page;
+		}
+		firstInPage.push_back(addrs.size());
+
+		m_pageBuffer.resize(pages.size() * m_pageSize);
+
+		PtraceMemory::RangeList_t reads;
+
+		for (size_t i = 0; i < pages.size(); i++) {
+			pages[i].m_data = &m_pageBuffer[i * m_pageSize];
+
+			// Armed pages are dirty, so always read
+			if (!getShadowPage(pid, pages[i]))
+				reads.push_back(pages[i]);
+		}
+
+		m_memory.read(pid, reads);
+
+		PtraceMemory::RangeList_t writes;
+
+		for (size_t i = 0; i < pages.size(); i++) {
+			PtraceMemory::Range &page = pages[i];
+			size_t first = firstInPage[i];
+			size_t last = firstInPage[i + 1];
+
+			if (arm) {
+				// Save the original instructions before patching anything
+				for (size_t j = first; j < last; j++) {
+					unsigned long addr = addrs[j];
+
+					m_instructionMap[addr] = readPageWord(page, addr);
+				}
+			}
+
+			for (size_t j = first; j < last; j++) {
+				unsigned long addr = addrs[j];
+				unsigned long cur = readPageWord(page, addr);
+
+				if (arm)
+					cur = arch_setupBreakpoint(addr, cur);
+				else
+					cur = arch_clearBreakpoint(addr, m_instructionMap[addr], cur);
+
+				writePageWord(page, addr, cur);
+			}
+
+			unsigned long start = getAligned(addrs[first]);
+			unsigned long end = getAligned(addrs[last - 1]) + sizeof(unsigned long);
+			uint8_t *data = page.m_data + (start - page.m_addr);
+
+			// Extend the previous write if the pages are consecutive
+			if (i != 0 && pages[i - 1].m_addr + m_pageSize == page.m_addr) {
+				PtraceMemory::Range &prev = writes.back();
+
+				prev.m_size = end - prev.m_addr;
+				continue;
+			}
+
+			writes.push_back(PtraceMemory::Range(start, end - start, data));
+		}
+
+		for (size_t i = 0; i < pages.size(); i++)
+			m_dirtyPages.insert(pages[i].m_addr);
+
+		m_memory.write(pid, writes);
+
+		kcov_debug(BP_MSG, "BP %s %zu breakpoints in %zu pages (%zu read) with %zu writes\n",
+				arm ? "armed" : "cleared", addrs.size(), pages.size(), reads.size(), writes.size());
+	}
+
+	/*
+	 * Get the original contents of a page from the shadow text. Pages we
+	 * have written to must be read from the process. A region is compared
+	 * as a whole against the first process using it, and only trusted for
+	 * that process afterwards.
+	 *
+	 * Returns true if the page data is valid.
+	 */
+	bool getShadowPage(pid_t pid, PtraceMemory::Range &page)
+	{
+		if (m_dirtyPages.find(page.m_addr) != m_dirtyPages.end())
+			return false;
+
+		IShadowText &shadow = IShadowText::getInstance();
+		enum IShadowText::LookupResult res = shadow.lookup(pid, page.m_addr, page.m_data, page.m_size);
+
+		if (res != IShadowText::SHADOW_UNVERIFIED)
+			return res == IShadowText::SHADOW_VALID;
+
+		std::vector<uint8_t> expected;
+		unsigned long start;
+
+		if (!shadow.getRegion(page.m_addr, start, expected))
+			return false;
+
+		std::vector<uint8_t> live(expected.size());
+		PtraceMemory::RangeList_t ranges;
+
+		ranges.push_back(PtraceMemory::Range(start, live.size(), &live[0]));
+		if (!m_memory.read(pid, ranges))
+			return false;
+
+		bool matches = live == expected;
+
+		kcov_debug(BP_MSG, "BP verified %zu bytes of shadow text at 0x%lx for %d: %s\n",
+				live.size(), start, pid, matches ? "ok" : "mismatch");
+
+		shadow.setVerified(pid, start, matches);
+
+		return shadow.lookup(pid, page.m_addr, page.m_data, page.m_size) == IShadowText::SHADOW_VALID;
+	}
+
+	unsigned long getPage(unsigned long addr)
+	{
+		return addr & ~((unsigned long)m_pageSize - 1);
+	}
+
+	unsigned long readPageWord(const PtraceMemory::Range &page, unsigned long addr)
+	{
+		unsigned long val;
+
+		memcpy(&val, page.m_data + (getAligned(addr) - page.m_addr), sizeof(val));
+
+		return val;
+	}
+
+	void writePageWord(PtraceMemory::Range &page, unsigned long addr, unsigned long val)
+	{
+		memcpy(page.m_data + (getAligned(addr) - page.m_addr), &val, sizeof(val));
 	}
 
 
@@ -558,7 +1165,11 @@ private:
 			return false;
 		}
 
-		ptrace(PTRACE_SETOPTIONS, m_activeChild, 0, PTRACE_O_TRACECLONE | PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK);
+		ptrace(PTRACE_SETOPTIONS, m_activeChild, 0, PTRACE_O_TRACECLONE | PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK |
+				(m_trackExec ? PTRACE_O_TRACEEXEC : 0));
+		m_stopped.push_back(StoppedChild(m_activeChild, 0));
+		m_processes.insert(m_activeChild);
+		setupRendezvous(m_activeChild);
 
 		return true;
 	}
@@ -568,6 +1179,17 @@ private:
 		int rv;
 
 		m_child = m_activeChild = m_firstChild = pid;
+		m_attachStart = get_ms_timestamp();
+		m_attached = true;
+
+		// Without stopping the program, if the kernel supports it
+		if (seizeAttach(pid)) {
+			tie_process_to_cpu(m_activeChild, m_parentCpu);
+			m_processes.insert(m_activeChild);
+			setupRendezvous(m_activeChild);
+
+			return true;
+		}
 
 		errno = 0;
 		rv = linuxAttach(m_activeChild);
@@ -593,7 +1215,70 @@ private:
 		tie_process_to_cpu(m_activeChild, m_parentCpu);
 
 		::kill(m_activeChild, SIGSTOP);
-		ptrace(PTRACE_SETOPTIONS, m_activeChild, 0, PTRACE_O_TRACECLONE | PTRACE_O_TRACEFORK);
+		ptrace(PTRACE_SETOPTIONS, m_activeChild, 0, PTRACE_O_TRACECLONE | PTRACE_O_TRACEFORK |
+				(m_trackExec ? PTRACE_O_TRACEEXEC : 0));
+		m_stopped.push_back(StoppedChild(m_activeChild, 0));
+		m_processes.insert(m_activeChild);
+		setupRendezvous(m_activeChild);
+		m_attachDone = get_ms_timestamp();
+
+		return true;
+	}
+
+	/*
+	 * Attach to all threads with PTRACE_SEIZE, which doesn't stop them.
+	 * New threads are traced automatically (PTRACE_O_TRACECLONE), so when a
+	 * scan of /proc/PID/task finds no new threads, all of them are traced.
+	 *
+	 * Breakpoints are then written through /proc/PID/mem while the program
+	 * runs.
+	 */
+	bool seizeAttach(pid_t pid)
+	{
+		unsigned long options = PTRACE_O_TRACECLONE | PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK |
+				(m_trackExec ? PTRACE_O_TRACEEXEC : 0);
+		std::string taskPath = fmt("/proc/%d/task", pid);
+
+		if (ptrace((__ptrace_request)PTRACE_SEIZE, pid, 0, options) < 0) {
+			kcov_debug(ENGINE_MSG, "PT can't seize %d (%s), attaching\n", pid, strerror(errno));
+
+			return false;
+		}
+		m_children[pid] = 1;
+		m_seized = true;
+
+		bool newThreads = true;
+
+		while (newThreads) {
+			DIR *dir = opendir(taskPath.c_str());
+			struct dirent *dp;
+
+			if (!dir)
+				break;
+
+			newThreads = false;
+			while ((dp = readdir(dir)) != NULL) {
+				pid_t tid = strtoul(dp->d_name, NULL, 10);
+
+				if (tid == 0 || m_children.find(tid) != m_children.end())
+					continue;
+
+				if (ptrace((__ptrace_request)PTRACE_SEIZE, tid, 0, options) < 0) {
+					// Created by a thread we have seized already?
+					if (errno == EPERM && linux_proc_get_int(tid, "TracerPid") == getpid())
+						m_children[tid] = 1;
+					else if (errno != ESRCH)
+						warning("Cannot attach to lwp %d\n", tid);
+
+					continue;
+				}
+
+				m_children[tid] = 1;
+				newThreads = true;
+			}
+			closedir(dir);
+		}
+		m_attachDone = get_ms_timestamp();
 
 		return true;
 	}
@@ -607,6 +1292,8 @@ private:
 		err = attachLwp (pid);
 		if (err != 0)
 			error ("Cannot attach to process %d\n", pid);
+		else
+			m_children[pid] = 1;
 
 		if (linux_proc_get_tgid (pid) != pid)
 		{
@@ -659,6 +1346,8 @@ private:
 					err = attachLwp (lwp);
 					if (err != 0)
 						warning ("Cannot attach to lwp %d\n", lwp);
+					else
+						m_children[lwp] = 1;
 
 					new_threads_found++;
 				}
@@ -712,6 +1401,20 @@ private:
 	}
 
 
+	/*
+	 * Is the SIGTRAP from a trap instruction, i.e., not from exec, a
+	 * single-step or kill()?
+	 */
+	bool isBreakpointTrap()
+	{
+		siginfo_t info;
+
+		if (ptrace(PTRACE_GETSIGINFO, m_activeChild, 0, &info) < 0)
+			return true;
+
+		return info.si_code == SI_KERNEL || info.si_code == TRAP_BRKPT;
+	}
+
 	// Skip over this instruction
 	void skipInstruction()
 	{
@@ -730,50 +1433,515 @@ private:
 #endif
 	}
 
-	unsigned long getPcFromRegs(unsigned long *regs)
+	// Return from the current function, which is stopped on its first instruction
+	void returnFromFunction(pid_t pid)
+	{
+#if defined(__i386__) || defined(__x86_64__)
+		struct user_regs_struct regs;
+
+		ptrace((__ptrace_request)PTRACE_GETREGS, pid, 0, &regs);
+# if defined(__x86_64__)
+		regs.rip = m_memory.peekWord(pid, regs.rsp);
+		regs.rsp += sizeof(unsigned long);
+# else
+		regs.eip = m_memory.peekWord(pid, regs.esp);
+		regs.esp += sizeof(unsigned long);
+# endif
+		ptrace((__ptrace_request)PTRACE_SETREGS, pid, 0, &regs);
+#elif defined(__powerpc__) || defined(__arm__)
+		unsigned long regs[1024];
+
+		ptrace((__ptrace_request)PTRACE_GETREGS, pid, 0, &regs);
+# if defined(__powerpc__)
+		regs[ppc_NIP] = regs[ppc_LNK];
+# else
+		regs[arm_PC] = regs[arm_LR];
+# endif
+		ptrace((__ptrace_request)PTRACE_SETREGS, pid, 0, &regs);
+#endif
+	}
+
+	/*
+	 * Break on the dynamic linker rendezvous function instead of using the
+	 * preloaded library (--solib-rendezvous). The breakpoint is permanent:
+	 * The function is empty, so a hit is handled by returning from it.
+	 */
+	void setupRendezvous(pid_t pid)
+	{
+		if (!m_useRendezvous)
+			return;
+
+		unsigned long addr = m_rendezvous.setup(pid);
+
+		if (addr == 0)
+			return;
+
+		PtraceMemory::RangeList_t ranges;
+
+		ranges.push_back(PtraceMemory::Range(getAligned(addr), sizeof(m_rendezvousData),
+				(uint8_t *)&m_rendezvousData));
+		m_memory.read(pid, ranges);
+		m_rendezvousAddr = addr;
+
+		// Through /proc/PID/mem, the process is running if seized
+		writeRendezvousWord(pid, arch_setupBreakpoint(addr, m_rendezvousData));
+		m_dirtyPages.insert(getPage(addr));
+
+		// The solibs which are already loaded (--pid)
+		queueRendezvous(pid);
+	}
+
+	void writeRendezvousWord(pid_t pid, unsigned long val)
 	{
-		return arch_getPcFromRegs(regs);
+		PtraceMemory::RangeList_t ranges;
+
+		ranges.push_back(PtraceMemory::Range(getAligned(m_rendezvousAddr), sizeof(val), (uint8_t *)&val));
+		m_memory.write(pid, ranges);
 	}
 
+	/*
+	 * The relocation of a PIE is known from the auxv directly after exec
+	 * (or attach), so the main file doesn't need to wait for the solib data.
+	 */
+	void queueMainRelocation(const std::string &executable)
+	{
+		unsigned long relocation;
+
+		if (!IConfiguration::getInstance().keyAsInt("parse-solibs") ||
+				!Rendezvous::getMainRelocation(m_firstChild, executable, &relocation))
+			return;
+
+		struct phdr_data *p = (struct phdr_data *)xmalloc(sizeof(struct phdr_data));
+
+		memset(p, 0, sizeof(*p));
+		p->relocation = relocation;
+		p->pid = m_firstChild;
+		queueSolibData(p);
+		m_relocationQueued = true;
+
+		kcov_debug(ENGINE_MSG, "PT main file relocation 0x%lx from the auxv\n", relocation);
+	}
+
+	// Parsed on the next tick, i.e., before the process continues
+	void queueRendezvous(pid_t pid)
+	{
+		struct phdr_data *p = m_rendezvous.read(pid);
+
+		if (p)
+			queueSolibData(p);
+	}
+
+	// Only reads the PC, not the whole register set
 	unsigned long getPc(int pid)
 	{
-		unsigned long regs[1024];
+		errno = 0;
+		unsigned long pc = ptrace((__ptrace_request)PTRACE_PEEKUSER, pid, arch_pcOffset(), 0);
 
-		memset(&regs, 0, sizeof(regs));
-		ptrace((__ptrace_request)PTRACE_GETREGS, pid, 0, &regs);
+		if (errno != 0)
+			pc = 0;
 
-		return getPcFromRegs(regs);
+		return arch_getBreakpointAddress(pc);
 	}
 
-	unsigned long peekWord(unsigned long addr)
+	/*
+	 * Remove the breakpoints which were hit from all traced processes, so
+	 * that forked children don't stop on them again. Running processes are
+	 * written through /proc/PID/mem.
+	 */
+	void propagateHits()
+	{
+		if (m_hitAddrs.empty())
+			return;
+
+		if (m_processes.size() > 1) {
+			for (ProcessSet_t::iterator it = m_processes.begin();
+					it != m_processes.end();
+					++it) {
+				std::vector<unsigned long> addrs = m_hitAddrs;
+
+				patchBreakpoints(*it, addrs, false);
+			}
+		}
+
+		m_hitAddrs.clear();
+	}
+
+	/*
+	 * --attach-window: Collect for a number of seconds, or until a file
+	 * exists, and then detach. A thread checks this, so that it also works
+	 * when the program doesn't stop.
+	 */
+	void setupAttachWindow()
+	{
+		IConfiguration &conf = IConfiguration::getInstance();
+		unsigned int seconds = conf.keyAsInt("attach-window");
+
+		m_windowFile = conf.keyAsString("attach-window-file");
+		if (seconds == 0 && m_windowFile == "")
+			return;
+
+		if (seconds != 0)
+			m_windowEnd = get_ms_timestamp() + seconds * 1000ULL;
+
+		struct sigaction sa;
+
+		// Without SA_RESTART, so that waitpid() returns EINTR
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = windowSignalHandler;
+		sigaction(SIGALRM, &sa, NULL);
+
+		m_tracerThread = pthread_self();
+		if (pthread_create(&m_windowThread, NULL, Ptrace::windowThreadStatic, (void *)this) == 0)
+			m_windowThreadValid = true;
+	}
+
+	void windowThread()
+	{
+		while (!m_windowDone) {
+			if ((m_windowEnd != 0 && get_ms_timestamp() >= m_windowEnd) ||
+					(m_windowFile != "" && file_exists(m_windowFile)))
+				break;
+
+			msleep(100);
+		}
+		m_windowEnded = true;
+
+		// Until the tracer has detached (the signal is lost if it's not waiting)
+		while (!m_windowDone) {
+			pthread_kill(m_tracerThread, SIGALRM);
+			msleep(100);
+		}
+	}
+
+	static void *windowThreadStatic(void *pThis)
+	{
+		Ptrace *p = (Ptrace *)pThis;
+
+		p->windowThread();
+
+		return NULL;
+	}
+
+	// The program then continues at full speed
+	bool endAttachWindow()
+	{
+		size_t n = detachFromAll();
+
+		kcov_debug(ENGINE_MSG, "PT attach window ended, detached from %zu threads\n", n);
+
+		m_detached = true;
+		m_activeChild = 0;
+		m_windowDone = true;
+
+		// The program itself continues
+		if (m_listener)
+			m_listener->onEvent(Event(ev_exit, 0));
+
+		return false;
+	}
+
+	/*
+	 * Restore all breakpoints which are still armed in one bulk write per
+	 * process, and detach from all threads.
+	 *
+	 * Returns the number of threads.
+	 */
+	size_t detachFromAll()
+	{
+		resumeStopped();
+
+		std::vector<unsigned long> pending = m_pendingBreakpoints;
+		std::vector<unsigned long> armed;
+
+		std::sort(pending.begin(), pending.end());
+		for (instructionMap_t::const_iterator it = m_instructionMap.begin();
+				it != m_instructionMap.end();
+				++it) {
+			if (!std::binary_search(pending.begin(), pending.end(), it->first))
+				armed.push_back(it->first);
+		}
+
+		// Written while running, so nothing can trap on them after this
+		if (m_rendezvousAddr != 0) {
+			for (ProcessSet_t::iterator it = m_processes.begin();
+					it != m_processes.end();
+					++it)
+				writeRendezvousWord(*it, m_rendezvousData);
+		}
+
+		if (!armed.empty()) {
+			for (ProcessSet_t::iterator it = m_processes.begin();
+					it != m_processes.end();
+					++it) {
+				std::vector<unsigned long> addrs = armed;
+
+				patchBreakpoints(*it, addrs, false);
+			}
+		}
+
+		ChildMap_t children = m_children;
+
+		for (ChildMap_t::iterator it = children.begin();
+				it != children.end();
+				++it) {
+			if (m_seized)
+				ptrace((__ptrace_request)PTRACE_INTERRUPT, it->first, 0, 0);
+			else
+				kill_lwp(it->first, SIGSTOP);
+		}
+
+		for (ChildMap_t::iterator it = children.begin();
+				it != children.end();
+				++it)
+			detachThread(it->first);
+
+		/*
+		 * The threads and processes created before the others stopped,
+		 * which haven't reported their first stop yet. They are traced
+		 * until then, so wait for it.
+		 */
+		size_t n = children.size() + m_newTasks.size();
+
+		while (!m_newTasks.empty()) {
+			pid_t tid = *m_newTasks.begin();
+
+			m_newTasks.erase(tid);
+			detachNewTask(tid, armed);
+		}
+
+		kcov_debug(ENGINE_MSG, "PT restored %zu breakpoints\n", armed.size());
+
+		return n;
+	}
+
+	/*
+	 * A new thread or process is stopped from the start until its first
+	 * stop is seen, so it hasn't run yet. A forked process can have a copy
+	 * of the breakpoints from before they were restored.
+	 */
+	void detachNewTask(pid_t tid, const std::vector<unsigned long> &armed)
+	{
+		int status;
+
+		if (waitpid(tid, &status, __WALL) < 0 || !WIFSTOPPED(status))
+			return;
+
+		if (m_processes.find(tid) != m_processes.end()) {
+			if (m_rendezvousAddr != 0)
+				writeRendezvousWord(tid, m_rendezvousData);
+
+			if (!armed.empty()) {
+				std::vector<unsigned long> addrs = armed;
+
+				patchBreakpoints(tid, addrs, false);
+			}
+			m_processes.erase(tid);
+		}
+		m_memory.forget(tid);
+
+		kcov_debug(ENGINE_MSG, "PT detaching new task %d\n", tid);
+		ptrace(PTRACE_DETACH, tid, 0, 0);
+	}
+
+	/*
+	 * Wait until a thread stops for the SIGSTOP/PTRACE_INTERRUPT we have
+	 * sent, and detach. Other stops which come before it are handled as
+	 * usual.
+	 */
+	void detachThread(pid_t tid)
+	{
+		while (1) {
+			int status;
+
+			if (waitpid(tid, &status, __WALL) < 0 || !WIFSTOPPED(status))
+				break;
+
+			// The SIGSTOP is consumed by detaching without a signal
+			if ((m_seized && (status >> 16) == PTRACE_EVENT_STOP) ||
+					(!m_seized && WSTOPSIG(status) == SIGSTOP && (status >> 16) == 0)) {
+				skipTrap(tid);
+				ptrace(PTRACE_DETACH, tid, 0, 0);
+				break;
+			}
+
+			Event ev = handleStop(tid, status);
+
+			if (m_listener)
+				m_listener->onEvent(ev);
+
+			ptrace(PTRACE_CONT, tid, 0, ev.type == ev_signal ? ev.data : 0);
+		}
+	}
+
+	bool breakpointsDone()
 	{
-		unsigned long aligned = getAligned(addr);
+		// Nothing registered yet, e.g., a PIE before the solib data has arrived
+		if (m_instructionMap.empty())
+			return false;
 
-		return ptrace((__ptrace_request)PTRACE_PEEKTEXT, m_activeChild, aligned, 0);
+		return m_armed.empty() && m_pendingBreakpoints.empty();
+	}
+
+	/*
+	 * All breakpoints have been hit (or cleared): Detach, so that the rest
+	 * of the run is native. kcov still waits for a forked program to exit,
+	 * and the solibs it loads after this are reported as not covered.
+	 */
+	bool detachWhenDone()
+	{
+		size_t n = detachFromAll();
+
+		kcov_debug(STATUS_MSG, "kcov: All breakpoints hit, detached from %zu threads\n", n);
+
+		m_detached = true;
+		if (!m_attached)
+			return true;
+
+		// Not our child, so we can't wait for it
+		m_activeChild = 0;
+		if (m_listener)
+			m_listener->onEvent(Event(ev_exit, 0));
+
+		return false;
+	}
+
+	void reportAttach()
+	{
+		// Stopped from the attach until now, unless seized
+		uint64_t stopped = m_seized ? 0 : get_ms_timestamp() - m_attachStart;
+
+		kcov_debug(STATUS_MSG, "kcov: Attached to %zu threads of %d in %llu ms, the program was stopped for %llu ms\n",
+				m_children.size(), m_firstChild,
+				(unsigned long long)(m_attachDone - m_attachStart), (unsigned long long)stopped);
+		m_attachStart = 0;
+	}
+
+	/*
+	 * Our breakpoints are restored, but the preloaded library might be
+	 * just about to force a trap. Step over it, since nothing would catch
+	 * it after the detach.
+	 */
+	void skipTrap(pid_t tid)
+	{
+		errno = 0;
+		unsigned long pc = ptrace((__ptrace_request)PTRACE_PEEKUSER, tid, arch_pcOffset(), 0);
+		uint8_t insn[4] = {0, 0, 0, 0};
+		PtraceMemory::RangeList_t ranges;
+
+		if (errno != 0)
+			return;
+
+		ranges.push_back(PtraceMemory::Range(pc, sizeof(insn), insn));
+		m_memory.read(tid, ranges);
+
+		unsigned int sz = arch_trapSize(insn);
+
+		if (sz != 0)
+			ptrace((__ptrace_request)PTRACE_POKEUSER, tid, arch_pcOffset(), pc + sz);
+	}
+
+	void resumeStopped()
+	{
+		for (StoppedList_t::iterator it = m_stopped.begin();
+				it != m_stopped.end();
+				++it) {
+			kcov_debug(ENGINE_MSG, "PT continuing %d with signal %lu\n", it->m_pid, it->m_signal);
+
+			if (ptrace(PTRACE_CONT, it->m_pid, 0, it->m_signal) < 0) {
+				kcov_debug(ENGINE_MSG, "PT error for %d\n", it->m_pid);
+				m_children.erase(it->m_pid);
+			}
+		}
+		m_stopped.clear();
+	}
+
+	unsigned long peekWord(unsigned long addr)
+	{
+		return m_memory.peekWord(m_activeChild, addr);
 	}
 
 	void pokeWord(unsigned long addr, unsigned long val)
 	{
-		ptrace((__ptrace_request)PTRACE_POKETEXT, m_activeChild, getAligned(addr), val);
+		m_memory.pokeWord(m_activeChild, addr, val);
 	}
 
 	typedef std::unordered_map<unsigned long, unsigned long > instructionMap_t;
 	typedef std::vector<unsigned long> PendingBreakpointList_t;
+	typedef std::unordered_map<unsigned long, pid_t> BreakpointOwnerMap_t; // Address -> process
 	typedef std::unordered_map<pid_t, int> ChildMap_t;
 
+	class StoppedChild
+	{
+	public:
+		StoppedChild(pid_t pid, unsigned long signal) :
+			m_pid(pid), m_signal(signal)
+		{
+		}
+
+		pid_t m_pid;
+		unsigned long m_signal; // Delivered when continuing
+	};
+	typedef std::vector<StoppedChild> StoppedList_t;
+	typedef std::unordered_set<pid_t> ProcessSet_t;
+
 	instructionMap_t m_instructionMap;
 	PendingBreakpointList_t m_pendingBreakpoints;
+	BreakpointOwnerMap_t m_breakpointOwners;
 	bool m_firstBreakpoint;
 
 	pid_t m_activeChild;
 	pid_t m_child;
 	pid_t m_firstChild;
 	ChildMap_t m_children;
+	StoppedList_t m_stopped;
+	ProcessSet_t m_processes; // Sharing our breakpoints, for --propagate-hits
+	ProcessSet_t m_newTasks; // Created, but the first stop hasn't been seen
 
 	int m_parentCpu;
 
 	IEventListener *m_listener;
-	unsigned long m_signal;
+
+	PtraceMemory m_memory;
+	size_t m_pageSize;
+	std::vector<uint8_t> m_pageBuffer;
+	std::unordered_set<unsigned long> m_dirtyPages;
+
+	Rendezvous m_rendezvous;
+	bool m_useRendezvous;
+	unsigned long m_rendezvousAddr; // Breakpoint on _dl_debug_state(), or 0
+	unsigned long m_rendezvousData; // The original word
+	bool m_relocationQueued;
+
+	// Trap handler mode
+	bool m_trapMode;
+	bool m_trapHandoverPending;
+	bool m_trapDetachPending;
+	bool m_detached;
+	std::string m_trapPath;
+	struct trap_data *m_trapData;
+	size_t m_trapDataSize;
+	std::vector<unsigned long> m_trapAddrs;
+	std::vector<uint32_t> m_trapReported;
+
+	bool m_propagateHits;
+	bool m_trackExec;
+	bool m_seized;
+	bool m_attached;
+	bool m_earlyDetach;
+	uint64_t m_quietPeriod; // ms
+	uint64_t m_doneSince; // ms timestamp when all breakpoints had been hit
+	std::unordered_set<unsigned long> m_armed; // Not hit yet, for --early-detach
+	uint64_t m_attachStart; // ms timestamps, for reporting
+	uint64_t m_attachDone;
+	std::vector<unsigned long> m_hitAddrs; // Cleared in this batch
+
+	uint64_t m_windowEnd; // ms timestamp, or 0
+	std::string m_windowFile;
+	pthread_t m_windowThread;
+	pthread_t m_tracerThread;
+	bool m_windowThreadValid;
+	std::atomic<bool> m_windowEnded;
+	std::atomic<bool> m_windowDone;
 };
 
 
@@ -0,0 +1,366 @@
+#include "rendezvous.hh"
+#include "ptrace-memory.hh"
+
+#include <utils.hh>
+#include <phdr_data.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <link.h>
+
+#include <vector>
+
+using namespace kcov;
+
+#if __ELF_NATIVE_CLASS == 64
+# define NATIVE_ELFCLASS ELFCLASS64
+#else
+# define NATIVE_ELFCLASS ELFCLASS32
+#endif
+
+// Names of the rendezvous function in different dynamic linkers
+static const char *debugStateNames[] =
+{
+	"_dl_debug_state",
+	"r_debug_state",
+	"_r_debug_state",
+	NULL,
+};
+
+static unsigned long getAuxvEntry(pid_t pid, unsigned long type)
+{
+	size_t sz;
+	ElfW(auxv_t) *auxv = (ElfW(auxv_t) *)read_file(&sz, "/proc/%d/auxv", pid);
+	unsigned long out = 0;
+
+	if (!auxv)
+		return 0;
+
+	for (size_t i = 0; i < sz / sizeof(*auxv) && auxv[i].a_type != AT_NULL; i++) {
+		if (auxv[i].a_type == type) {
+			out = auxv[i].a_un.a_val;
+			break;
+		}
+	}
+	free(auxv);
+
+	return out;
+}
+
+// The file mapped at addr (the start of a mapping)
+static std::string getMappedFile(pid_t pid, unsigned long addr)
+{
+	size_t sz;
+	char *maps = (char *)read_file(&sz, "/proc/%d/maps", pid);
+	std::string out;
+
+	if (!maps)
+		return out;
+
+	// "7f0e4c1d2000-7f0e4c1f8000 r--p 00000000 fd:01 1234  /lib/ld-linux.so.2"
+	std::vector<std::string> lines = split_string(std::string(maps, sz), "\n");
+
+	free(maps);
+	for (std::vector<std::string>::const_iterator it = lines.begin();
+			it != lines.end();
+			++it) {
+		const std::string &cur = *it;
+		size_t path = cur.find('/');
+
+		if (path == std::string::npos || strtoul(cur.c_str(), NULL, 16) != addr)
+			continue;
+
+		out = cur.substr(path);
+		break;
+	}
+
+	return out;
+}
+
+/*
+ * Read the loadable segments of a file, relocated to base. Only the
+ * headers are read.
+ */
+static bool readSegments(const std::string &path, unsigned long base, struct phdr_data_entry *entry)
+{
+	int fd = open(path.c_str(), O_RDONLY);
+	bool out = false;
+	ElfW(Ehdr) ehdr;
+
+	if (fd < 0)
+		return false;
+
+	if (pread(fd, &ehdr, sizeof(ehdr), 0) != sizeof(ehdr) ||
+			memcmp(ehdr.e_ident, ELFMAG, SELFMAG) != 0 ||
+			ehdr.e_ident[EI_CLASS] != NATIVE_ELFCLASS ||
+			ehdr.e_phentsize != sizeof(ElfW(Phdr)))
+		goto out_close;
+
+	memset(entry, 0, sizeof(*entry));
+	strncpy(entry->name, path.c_str(), sizeof(entry->name) - 1);
+
+	for (unsigned int i = 0; i < ehdr.e_phnum; i++) {
+		ElfW(Phdr) phdr;
+
+		if (pread(fd, &phdr, sizeof(phdr), ehdr.e_phoff + i * sizeof(phdr)) != sizeof(phdr))
+			goto out_close;
+
+		if (phdr.p_type != PT_LOAD ||
+				entry->n_segments >= sizeof(entry->segments) / sizeof(entry->segments[0]))
+			continue;
+
+		struct phdr_data_segment *seg = &entry->segments[entry->n_segments++];
+
+		seg->paddr = phdr.p_paddr;
+		seg->vaddr = base + phdr.p_vaddr;
+		seg->size = phdr.p_memsz;
+	}
+	out = true;
+
+out_close:
+	close(fd);
+
+	return out;
+}
+
+Rendezvous::Rendezvous(PtraceMemory &memory) :
+		m_memory(memory),
+		m_debugStateAddr(0),
+		m_rDebugAddr(0),
+		m_hasRelocation(false)
+{
+}
+
+unsigned long Rendezvous::setup(pid_t pid)
+{
+	unsigned long base = getAuxvEntry(pid, AT_BASE);
+
+	// No dynamic linker
+	if (base == 0)
+		return 0;
+
+	std::string interp = getMappedFile(pid, base);
+
+	if (interp == "" || !lookupSymbols(interp, base)) {
+		warning("Can't find the dynamic linker rendezvous in %s", interp.c_str());
+		return 0;
+	}
+
+	kcov_debug(ENGINE_MSG, "RV %s at 0x%lx: _dl_debug_state 0x%lx, _r_debug 0x%lx\n",
+			interp.c_str(), base, m_debugStateAddr, m_rDebugAddr);
+
+	return m_debugStateAddr;
+}
+
+/*
+ * Lookup the rendezvous symbols in the dynamic symbol table (or the
+ * normal one, if there) of the dynamic linker.
+ */
+bool Rendezvous::lookupSymbols(const std::string &path, unsigned long base)
+{
+	size_t sz;
+	uint8_t *data = (uint8_t *)read_file(&sz, "%s", path.c_str());
+	ElfW(Ehdr) *ehdr = (ElfW(Ehdr) *)data;
+
+	m_debugStateAddr = 0;
+	m_rDebugAddr = 0;
+
+	if (!data)
+		return false;
+
+	if (sz < sizeof(*ehdr) ||
+			memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 ||
+			ehdr->e_ident[EI_CLASS] != NATIVE_ELFCLASS ||
+			ehdr->e_shentsize != sizeof(ElfW(Shdr)) ||
+			ehdr->e_shoff + ehdr->e_shnum * sizeof(ElfW(Shdr)) > sz) {
+		free(data);
+		return false;
+	}
+
+	ElfW(Shdr) *shdrs = (ElfW(Shdr) *)(data + ehdr->e_shoff);
+
+	for (unsigned int i = 0; i < ehdr->e_shnum; i++) {
+		ElfW(Shdr) *symtab = &shdrs[i];
+
+		if ((symtab->sh_type != SHT_DYNSYM && symtab->sh_type != SHT_SYMTAB) ||
+				symtab->sh_link >= ehdr->e_shnum)
+			continue;
+
+		ElfW(Shdr) *strtab = &shdrs[symtab->sh_link];
+
+		if (symtab->sh_offset + symtab->sh_size > sz ||
+				strtab->sh_offset + strtab->sh_size > sz)
+			continue;
+
+		ElfW(Sym) *syms = (ElfW(Sym) *)(data + symtab->sh_offset);
+		const char *strs = (const char *)(data + strtab->sh_offset);
+
+		for (size_t j = 0; j < symtab->sh_size / sizeof(ElfW(Sym)); j++) {
+			ElfW(Sym) *sym = &syms[j];
+
+			if (sym->st_name >= strtab->sh_size || sym->st_value == 0)
+				continue;
+
+			const char *name = &strs[sym->st_name];
+
+			if (strcmp(name, "_r_debug") == 0)
+				m_rDebugAddr = base + sym->st_value;
+
+			for (unsigned int k = 0; debugStateNames[k]; k++) {
+				if (strcmp(name, debugStateNames[k]) == 0)
+					m_debugStateAddr = base + sym->st_value;
+			}
+		}
+	}
+	free(data);
+
+	return m_debugStateAddr != 0 && m_rDebugAddr != 0;
+}
+
+bool Rendezvous::getMainRelocation(pid_t pid, const std::string &executable, unsigned long *out)
+{
+	int fd = open(executable.c_str(), O_RDONLY);
+	bool res = false;
+	ElfW(Ehdr) ehdr;
+
+	if (fd < 0)
+		return false;
+
+	if (pread(fd, &ehdr, sizeof(ehdr), 0) != sizeof(ehdr) ||
+			memcmp(ehdr.e_ident, ELFMAG, SELFMAG) != 0 ||
+			ehdr.e_ident[EI_CLASS] != NATIVE_ELFCLASS ||
+			ehdr.e_type != ET_DYN)
+		goto out_close;
+
+	// Where the program headers are mapped, if they are
+	for (unsigned int i = 0; i < ehdr.e_phnum; i++) {
+		ElfW(Phdr) phdr;
+		unsigned long addr;
+
+		if (pread(fd, &phdr, sizeof(phdr), ehdr.e_phoff + i * sizeof(phdr)) != sizeof(phdr))
+			break;
+
+		if (phdr.p_type != PT_PHDR)
+			continue;
+
+		addr = getAuxvEntry(pid, AT_PHDR);
+		if (addr != 0) {
+			*out = addr - phdr.p_vaddr;
+			res = true;
+		}
+		goto out_close;
+	}
+
+	// Otherwise through the entry point
+	if (getAuxvEntry(pid, AT_ENTRY) != 0) {
+		*out = getAuxvEntry(pid, AT_ENTRY) - ehdr.e_entry;
+		res = true;
+	}
+
+out_close:
+	close(fd);
+
+	return res;
+}
+
+struct phdr_data *Rendezvous::read(pid_t pid)
+{
+	PtraceMemory::RangeList_t ranges;
+	struct r_debug rd;
+
+	if (m_rDebugAddr == 0)
+		return NULL;
+
+	memset(&rd, 0, sizeof(rd));
+	ranges.push_back(PtraceMemory::Range(m_rDebugAddr, sizeof(rd), (uint8_t *)&rd));
+	m_memory.read(pid, ranges);
+
+	// Not setup yet (just after exec), or objects are being added/removed
+	if (rd.r_map == NULL || rd.r_state != r_debug::RT_CONSISTENT)
+		return NULL;
+
+	std::vector<struct phdr_data_entry> entries;
+	unsigned long relocation = 0;
+	unsigned long addr = (unsigned long)rd.r_map;
+
+	// The main program is first. Bounded, in case the list is broken
+	for (unsigned int n = 0; addr != 0 && n < 0x10000; n++) {
+		struct link_map lm;
+
+		memset(&lm, 0, sizeof(lm));
+		ranges.clear();
+		ranges.push_back(PtraceMemory::Range(addr, sizeof(lm), (uint8_t *)&lm));
+		m_memory.read(pid, ranges);
+		addr = (unsigned long)lm.l_next;
+
+		if (n == 0) {
+			relocation = lm.l_addr;
+			continue;
+		}
+
+		std::string name = readString(pid, (unsigned long)lm.l_name);
+
+		if (name == "" || m_reported.find(name) != m_reported.end())
+			continue;
+
+		// Not retried, e.g., the vdso has no file
+		m_reported.insert(name);
+
+		struct phdr_data_entry entry;
+
+		if (readSegments(name, lm.l_addr, &entry))
+			entries.push_back(entry);
+	}
+
+	if (entries.empty() && m_hasRelocation)
+		return NULL;
+	m_hasRelocation = true;
+
+	size_t sz = sizeof(struct phdr_data) + entries.size() * sizeof(struct phdr_data_entry);
+	struct phdr_data *out = (struct phdr_data *)xmalloc(sz);
+
+	memset(out, 0, sizeof(*out));
+	out->relocation = relocation;
+	out->pid = pid;
+	out->n_entries = entries.size();
+	if (!entries.empty())
+		memcpy(out->entries, &entries[0], entries.size() * sizeof(struct phdr_data_entry));
+
+	kcov_debug(ENGINE_MSG, "RV %zu new objects in %d\n", entries.size(), pid);
+
+	return out;
+}
+
+// Read within one page at a time, the string might end just before an unmapped one
+std::string Rendezvous::readString(pid_t pid, unsigned long addr)
+{
+	size_t pageSize = getpagesize();
+	std::string out;
+
+	if (addr == 0)
+		return out;
+
+	while (out.size() < sizeof(((struct phdr_data_entry *)0)->name) - 1) {
+		char buf[256];
+		size_t sz = pageSize - (addr & (pageSize - 1));
+		PtraceMemory::RangeList_t ranges;
+
+		if (sz > sizeof(buf))
+			sz = sizeof(buf);
+
+		memset(buf, 0, sizeof(buf));
+		ranges.push_back(PtraceMemory::Range(addr, sz, (uint8_t *)buf));
+		m_memory.read(pid, ranges);
+
+		size_t len = strnlen(buf, sz);
+
+		out.append(buf, len);
+		if (len < sz)
+			break;
+		addr += sz;
+	}
+
+	return out;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <sys/types.h>
+#include <stdint.h>
+
+#include <string>
+#include <unordered_set>
+
+struct phdr_data;
+
+namespace kcov
+{
+	class PtraceMemory;
+
+	/**
+	 * Solib discovery through the dynamic linker rendezvous, as debuggers
+	 * do it: The dynamic linker calls _dl_debug_state() each time the list
+	 * of loaded objects has changed, and the list (r_debug/link_map) is
+	 * then read from the memory of the stopped process.
+	 *
+	 * Only for programs with the same word size as kcov.
+	 */
+	class Rendezvous
+	{
+	public:
+		Rendezvous(PtraceMemory &memory);
+
+		/**
+		 * Lookup the rendezvous of a process. The dynamic linker must be
+		 * mapped, i.e., it's enough that the process has just exec:ed.
+		 *
+		 * @param pid the process
+		 *
+		 * @return the address to set a breakpoint at, or 0 if the program
+		 * is static or the dynamic linker isn't known
+		 */
+		unsigned long setup(pid_t pid);
+
+		/**
+		 * Read the objects which have been loaded since the last call.
+		 *
+		 * @param pid the process, stopped
+		 *
+		 * @return the solib data (free:d by the receiver), or NULL if the
+		 * list is being changed or has no new objects
+		 */
+		struct phdr_data *read(pid_t pid);
+
+		/**
+		 * Get the load address of a position-independent executable from
+		 * the auxv of the process, which is available directly after exec.
+		 *
+		 * @param pid the process
+		 * @param executable the program file
+		 * @param out the relocation
+		 *
+		 * @return false if the program isn't position-independent, or the
+		 * relocation can't be found
+		 */
+		static bool getMainRelocation(pid_t pid, const std::string &executable, unsigned long *out);
+
+	private:
+		bool lookupSymbols(const std::string &path, unsigned long base);
+
+		std::string readString(pid_t pid, unsigned long addr);
+
+		PtraceMemory &m_memory;
+		unsigned long m_debugStateAddr; // _dl_debug_state()
+		unsigned long m_rDebugAddr; // _r_debug
+		bool m_hasRelocation;
+		std::unordered_set<std::string> m_reported;
+	};
+}
@@ -0,0 +1,300 @@
+#include <engine.hh>
+#include <utils.hh>
+#include <configuration.hh>
+#include <output-handler.hh>
+#include <file-parser.hh>
+#include <trap_data.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <libelf.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "static-modules.hh"
+
+using namespace kcov;
+
+/**
+ * The trap handler mode armed at startup (--trap-handler=startup): The
+ * program runs without a tracer. The preloaded library sets up the
+ * breakpoints in each module when the program starts, and records the hits
+ * with the same SIGTRAP handler as in the ptrace handover mode, in a shared
+ * bitmap which kcov polls.
+ */
+class StartupTrapEngine : public IEngine
+{
+public:
+	StartupTrapEngine(IFileParser &parser) :
+		m_parser(parser),
+		m_listener(NULL),
+		m_child(-1),
+		m_started(false),
+		m_data(NULL),
+		m_dataSize(0),
+		m_dataFd(-1)
+	{
+	}
+
+	~StartupTrapEngine()
+	{
+		kill(SIGTERM);
+
+		if (m_data)
+			munmap(m_data, m_dataSize);
+		if (m_dataFd >= 0)
+			close(m_dataFd);
+	}
+
+	int registerBreakpoint(unsigned long addr)
+	{
+		if (addr == 0)
+			return -1;
+
+		m_breakpoints.push_back(addr);
+
+		return 0;
+	}
+
+	bool start(IEventListener &listener, const std::string &executable)
+	{
+		m_listener = &listener;
+		m_executable = executable;
+
+		if (access(executable.c_str(), X_OK) != 0)
+			return false;
+
+		// Started on the first continueExecution(), when all breakpoints are known
+		return true;
+	}
+
+	bool continueExecution()
+	{
+		if (!m_started) {
+			m_started = true;
+
+			if (!launch()) {
+				m_listener->onEvent(Event(ev_error, -1));
+
+				return false;
+			}
+
+			return true;
+		}
+
+		int status;
+		pid_t who = waitpid(m_child, &status, WNOHANG);
+
+		// Read after the wait, so that hits just before the exit are included
+		reportHits();
+
+		if (who == 0) {
+			msleep(50);
+
+			return true;
+		}
+
+		Event ev(ev_error, -1);
+
+		if (who > 0 && WIFEXITED(status))
+			ev = Event(ev_exit_first_process, WEXITSTATUS(status));
+		else if (who > 0 && WIFSIGNALED(status))
+			ev = Event(ev_signal_exit, WTERMSIG(status));
+
+		m_listener->onEvent(ev);
+		m_child = -1;
+
+		return false;
+	}
+
+	void kill(int sig)
+	{
+		if (m_child > 0)
+			::kill(m_child, sig);
+	}
+
+private:
+	bool launch()
+	{
+		IConfiguration &conf = IConfiguration::getInstance();
+
+		if (!m_modules.parse(m_parser, m_executable)) {
+			error("Can't read %s", m_executable.c_str());
+			return false;
+		}
+
+		if (!writeTable())
+			return false;
+
+		std::string preload = IOutputHandler::getInstance().getBaseDirectory() + "libkcov_sowrapper.so";
+		char *const *argv = (char *const *)conf.getArgv();
+
+		m_child = fork();
+		if (m_child == 0) {
+			setenv("LD_PRELOAD", preload.c_str(), 1);
+			setenv("KCOV_STARTUP_TRAP_FD", fmt("%d", m_dataFd).c_str(), 1);
+			execv(m_executable.c_str(), argv);
+
+			perror("execv");
+			_exit(127);
+		} else if (m_child < 0) {
+			perror("fork");
+
+			return false;
+		}
+
+		kcov_debug(ENGINE_MSG, "STARTUP started %d with %zu breakpoints in %zu modules\n",
+				m_child, m_breakpoints.size(), m_modules.getModules().size());
+
+		return true;
+	}
+
+	/*
+	 * Write the module-relative breakpoint list for the preloaded library,
+	 * in memory which is shared with (and inherited by) the program.
+	 */
+	bool writeTable()
+	{
+		const StaticModules::ModuleList_t &modules = m_modules.getModules();
+
+		// Sorted by module, then by offset
+		std::sort(m_breakpoints.begin(), m_breakpoints.end());
+		m_breakpoints.erase(std::unique(m_breakpoints.begin(), m_breakpoints.end()),
+				m_breakpoints.end());
+
+		m_dataSize = startup_trap_data_size(modules.size(), m_breakpoints.size());
+		m_dataFd = createSharedFd();
+		if (m_dataFd < 0 || ftruncate(m_dataFd, m_dataSize) < 0) {
+			error("Can't create the startup trap data");
+			return false;
+		}
+
+		void *p = mmap(NULL, m_dataSize, PROT_READ | PROT_WRITE, MAP_SHARED, m_dataFd, 0);
+		if (p == MAP_FAILED)
+			return false;
+
+		m_data = (struct startup_trap_data *)p;
+		m_data->magic = KCOV_STARTUP_TRAP_MAGIC;
+		m_data->version = KCOV_STARTUP_TRAP_VERSION;
+		m_data->n_modules = modules.size();
+		m_data->n_entries = m_breakpoints.size();
+
+		for (unsigned int i = 0; i < modules.size(); i++) {
+			struct startup_trap_module *mod = &m_data->modules[i];
+
+			strncpy(mod->name, modules[i].m_path.c_str(), sizeof(mod->name) - 1);
+			mod->first_entry = 0;
+			mod->n_entries = 0;
+		}
+
+		unsigned long *offsets = startup_trap_data_offsets(m_data);
+
+		for (size_t i = 0; i < m_breakpoints.size(); i++) {
+			unsigned int idx = StaticModules::getModuleIndex(m_breakpoints[i]);
+
+			// Shouldn't happen, but don't trust the parser blindly
+			if (idx >= modules.size())
+				continue;
+
+			struct startup_trap_module *mod = &m_data->modules[idx];
+
+			if (mod->n_entries == 0)
+				mod->first_entry = i;
+			mod->n_entries++;
+
+			offsets[i] = StaticModules::getModuleOffset(m_breakpoints[i]);
+		}
+		m_reported.assign(trap_data_bitmap_words(m_breakpoints.size()), 0);
+
+		return true;
+	}
+
+	int createSharedFd()
+	{
+		int fd = -1;
+
+#if defined(__NR_memfd_create)
+		fd = syscall(__NR_memfd_create, "kcov-startup-traps", 0);
+		if (fd >= 0)
+			return fd;
+#endif
+
+		// Fall back to an unlinked file
+		std::string path = IOutputHandler::getInstance().getOutDirectory() + "kcov-startup-traps.data";
+
+		fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+		unlink(path.c_str());
+
+		return fd;
+	}
+
+	void reportHits()
+	{
+		uint32_t *bitmap = startup_trap_data_bitmap(m_data);
+
+		for (size_t i = 0; i < m_reported.size(); i++) {
+			uint32_t cur = bitmap[i] & ~m_reported[i];
+
+			if (cur == 0)
+				continue;
+
+			m_reported[i] |= cur;
+			for (unsigned int bit = 0; bit < 32; bit++) {
+				if (cur & (1U << bit))
+					m_listener->onEvent(Event(ev_breakpoint, -1, m_breakpoints[i * 32 + bit]));
+			}
+		}
+	}
+
+	IFileParser &m_parser;
+	IEventListener *m_listener;
+	std::string m_executable;
+	pid_t m_child;
+	bool m_started;
+
+	StaticModules m_modules;
+	std::vector<unsigned long> m_breakpoints;
+	std::vector<uint32_t> m_reported;
+	struct startup_trap_data *m_data;
+	size_t m_dataSize;
+	int m_dataFd;
+};
+
+
+class StartupTrapEngineCreator : public IEngineFactory::IEngineCreator
+{
+public:
+	virtual ~StartupTrapEngineCreator()
+	{
+	}
+
+	virtual IEngine *create(IFileParser &parser)
+	{
+		return new StartupTrapEngine(parser);
+	}
+
+	unsigned int matchFile(const std::string &filename, uint8_t *data, size_t dataSize)
+	{
+		if (!IConfiguration::getInstance().keyAsInt("trap-handler-startup"))
+			return match_none;
+
+#if defined(__x86_64__)
+		// Only ELF binaries (not scripts)
+		if (dataSize >= SELFMAG && memcmp(data, ELFMAG, SELFMAG) == 0)
+			return match_perfect;
+#endif
+
+		return match_none;
+	}
+};
+
+static StartupTrapEngineCreator g_startupTrapEngineCreator;
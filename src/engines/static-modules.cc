@@ -0,0 +1,218 @@
+#include "static-modules.hh"
+
+#include <file-parser.hh>
+#include <configuration.hh>
+#include <phdr_data.h>
+#include <utils.hh>
+
+#include <libelf.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+using namespace kcov;
+
+/*
+ * Read the loadable segments of an ELF file, relocated to base. Returns
+ * false if the file can't be parsed.
+ */
+static bool readSegments(const std::string &path, uint64_t base,
+		struct phdr_data_entry *entry, StaticModules::Module &module, bool *isDynamic)
+{
+	size_t sz;
+	char *data = (char *)read_file(&sz, "%s", path.c_str());
+	bool out = false;
+	size_t n;
+
+	if (!data)
+		return false;
+
+	Elf *elf = elf_memory(data, sz);
+	if (!elf || elf_getphdrnum(elf, &n) < 0)
+		goto out_free;
+
+	memset(entry, 0, sizeof(*entry));
+	strncpy(entry->name, path.c_str(), sizeof(entry->name) - 1);
+	*isDynamic = false;
+
+	for (size_t i = 0; i < n; i++) {
+		uint64_t type, offset, paddr, vaddr, memsz;
+
+		if (elf_getident(elf, NULL)[EI_CLASS] == ELFCLASS32) {
+			Elf32_Phdr *phdr = &elf32_getphdr(elf)[i];
+
+			type = phdr->p_type;
+			offset = phdr->p_offset;
+			paddr = phdr->p_paddr;
+			vaddr = phdr->p_vaddr;
+			memsz = phdr->p_memsz;
+		} else {
+			Elf64_Phdr *phdr = &elf64_getphdr(elf)[i];
+
+			type = phdr->p_type;
+			offset = phdr->p_offset;
+			paddr = phdr->p_paddr;
+			vaddr = phdr->p_vaddr;
+			memsz = phdr->p_memsz;
+		}
+
+		if (type == PT_INTERP)
+			*isDynamic = true;
+
+		if (type != PT_LOAD ||
+				entry->n_segments >= sizeof(entry->segments) / sizeof(entry->segments[0]))
+			continue;
+
+		struct phdr_data_segment *seg = &entry->segments[entry->n_segments++];
+
+		seg->paddr = paddr;
+		seg->vaddr = base + vaddr;
+		seg->size = memsz;
+
+		module.m_segments.push_back(StaticModules::Segment(vaddr, offset, memsz));
+	}
+	out = true;
+
+out_free:
+	if (elf)
+		elf_end(elf);
+	free(data);
+
+	return out;
+}
+
+bool StaticModules::parse(IFileParser &parser, const std::string &executable)
+{
+	IConfiguration &conf = IConfiguration::getInstance();
+	struct phdr_data_entry entry;
+	bool isDynamic;
+
+	m_modules.clear();
+
+	Module main(get_real_path(executable));
+
+	if (!readSegments(executable, 0, &entry, main, &isDynamic))
+		return false;
+
+	m_modules.push_back(main);
+
+	if (!conf.keyAsInt("parse-solibs"))
+		return true;
+
+	// Parsing of PIEs is deferred until the relocation is known, which is 0 here
+	parser.setMainFileRelocation(0);
+
+	if (!isDynamic)
+		return true;
+
+	std::vector<std::string> libs = getSharedLibraries(executable);
+
+	for (std::vector<std::string>::const_iterator it = libs.begin();
+			it != libs.end();
+			++it) {
+		const std::string &path = get_real_path(*it);
+		unsigned int idx = m_modules.size();
+		Module cur(path);
+
+		if (!readSegments(path, getAddress(idx, 0), &entry, cur, &isDynamic))
+			continue;
+
+		m_modules.push_back(cur);
+
+		parser.addFile(path, &entry);
+		parser.parse();
+	}
+
+	return true;
+}
+
+bool StaticModules::getFileOffset(uint64_t addr, uint64_t *out) const
+{
+	unsigned int idx = getModuleIndex(addr);
+	uint64_t vaddr = getModuleOffset(addr);
+
+	if (idx >= m_modules.size())
+		return false;
+
+	const SegmentList_t &segments = m_modules[idx].m_segments;
+
+	for (SegmentList_t::const_iterator it = segments.begin();
+			it != segments.end();
+			++it) {
+		if (vaddr >= it->m_vaddr && vaddr < it->m_vaddr + it->m_size) {
+			*out = vaddr - it->m_vaddr + it->m_offset;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Let the dynamic linker list the libraries (what ldd does), without
+ * the kcov library preloaded.
+ */
+std::vector<std::string> StaticModules::getSharedLibraries(const std::string &executable)
+{
+	std::vector<std::string> out;
+	std::string output;
+	int fds[2];
+	pid_t child;
+
+	if (pipe(fds) < 0)
+		return out;
+
+	child = fork();
+	if (child == 0) {
+		close(fds[0]);
+		dup2(fds[1], STDOUT_FILENO);
+
+		unsetenv("LD_PRELOAD");
+		setenv("LD_TRACE_LOADED_OBJECTS", "1", 1);
+		execl(executable.c_str(), executable.c_str(), (char *)NULL);
+		_exit(1);
+	}
+	close(fds[1]);
+
+	if (child < 0) {
+		close(fds[0]);
+		return out;
+	}
+
+	while (1) {
+		char buf[4096];
+		ssize_t r = read(fds[0], buf, sizeof(buf));
+
+		if (r <= 0)
+			break;
+		output.append(buf, r);
+	}
+	close(fds[0]);
+	waitpid(child, NULL, 0);
+
+	// "libc.so.6 => /lib/libc.so.6 (0x...)" or "/lib64/ld-linux-x86-64.so.2 (0x...)"
+	std::vector<std::string> lines = split_string(output, "\n");
+
+	for (std::vector<std::string>::const_iterator it = lines.begin();
+			it != lines.end();
+			++it) {
+		std::string cur = trim_string(*it);
+		size_t arrow = cur.find("=> ");
+
+		if (arrow != std::string::npos)
+			cur = cur.substr(arrow + 3);
+
+		size_t end = cur.find(" (");
+		if (end != std::string::npos)
+			cur = cur.substr(0, end);
+
+		if (cur.size() == 0 || cur[0] != '/')
+			continue;
+
+		out.push_back(cur);
+	}
+
+	return out;
+}
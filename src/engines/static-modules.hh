@@ -0,0 +1,103 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+namespace kcov
+{
+	class IFileParser;
+
+	/**
+	 * The main executable and the shared libraries it will load, for
+	 * engines which need all breakpoint addresses before the program is
+	 * started.
+	 *
+	 * Each module is parsed at a fake load base (its index shifted up), so
+	 * the addresses reported to the collector encode the module and the
+	 * offset from the run-time load base of the module.
+	 */
+	class StaticModules
+	{
+	public:
+		class Segment
+		{
+		public:
+			Segment(uint64_t vaddr, uint64_t offset, uint64_t size) :
+				m_vaddr(vaddr), m_offset(offset), m_size(size)
+			{
+			}
+
+			uint64_t m_vaddr; // Relative to the load base
+			uint64_t m_offset; // In the file
+			uint64_t m_size;
+		};
+		typedef std::vector<Segment> SegmentList_t;
+
+		class Module
+		{
+		public:
+			Module(const std::string &path) :
+				m_path(path)
+			{
+			}
+
+			std::string m_path; // Real path
+			SegmentList_t m_segments;
+		};
+		typedef std::vector<Module> ModuleList_t;
+
+		/**
+		 * Find and parse the executable and its shared libraries.
+		 *
+		 * The executable itself must have been added to the parser.
+		 *
+		 * @param parser the parser to add the libraries to
+		 * @param executable the program which will be run
+		 *
+		 * @return false if the executable can't be read
+		 */
+		bool parse(IFileParser &parser, const std::string &executable);
+
+		const ModuleList_t &getModules() const
+		{
+			return m_modules;
+		}
+
+		/**
+		 * Lookup the file offset of an address.
+		 *
+		 * @param addr the address, as reported to the collector
+		 * @param out the offset in the module file
+		 *
+		 * @return false if the address isn't within a loadable segment
+		 */
+		bool getFileOffset(uint64_t addr, uint64_t *out) const;
+
+		static unsigned int getModuleIndex(uint64_t addr)
+		{
+			return addr >> moduleShift;
+		}
+
+		static uint64_t getModuleOffset(uint64_t addr)
+		{
+			return addr & ((1ULL << moduleShift) - 1);
+		}
+
+		static uint64_t getAddress(unsigned int module, uint64_t offset)
+		{
+			return ((uint64_t)module << moduleShift) | offset;
+		}
+
+	private:
+		enum
+		{
+			moduleShift = 40,
+		};
+
+		std::vector<std::string> getSharedLibraries(const std::string &executable);
+
+		ModuleList_t m_modules;
+	};
+}
@@ -0,0 +1,555 @@
+#include <engine.hh>
+#include <utils.hh>
+#include <configuration.hh>
+#include <file-parser.hh>
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <dirent.h>
+#include <linux/perf_event.h>
+#include <libelf.h>
+
+#include <vector>
+#include <unordered_map>
+
+#include "static-modules.hh"
+
+using namespace kcov;
+
+#define UPROBE_TYPE_PATH "/sys/bus/event_source/devices/uprobe/type"
+
+static int perfEventOpen(struct perf_event_attr *attr, pid_t pid, int groupFd)
+{
+#if defined(__NR_perf_event_open)
+	return syscall(__NR_perf_event_open, attr, pid, -1, groupFd, 0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+// The number of threads of a process, from /proc
+static unsigned int countThreads(pid_t pid)
+{
+	std::string path = fmt("/proc/%d/task", pid);
+	DIR *dir = opendir(path.c_str());
+	unsigned int out = 0;
+	struct dirent *de;
+
+	if (!dir)
+		return 0;
+
+	while ((de = readdir(dir))) {
+		if (de->d_name[0] != '.')
+			out++;
+	}
+	closedir(dir);
+
+	return out;
+}
+
+/**
+ * Engine which collects hits with uprobes, i.e., the kernel sets the
+ * breakpoints and counts the hits. The program is not stopped on hits,
+ * and can be traced by something else.
+ *
+ * The probes are counting events in groups, so that the counts of a
+ * whole group are read with one read(). Sampling to a ring buffer is not
+ * possible, since the kernel doesn't allow mmap of per-process events
+ * which are inherited by threads and forked children.
+ *
+ * The leader of each group is a dummy software event, so that every
+ * probe can be closed after its first hit: The kernel removes the uprobe
+ * from the text when the last event for it is gone.
+ */
+class UprobeEngine : public IEngine
+{
+public:
+	UprobeEngine(IFileParser &parser) :
+		m_parser(parser),
+		m_listener(NULL),
+		m_child(-1),
+		m_attached(false),
+		m_started(false),
+		m_uprobeType(-1)
+	{
+	}
+
+	~UprobeEngine()
+	{
+		if (!m_attached)
+			kill(SIGTERM);
+
+		for (ProbeList_t::iterator it = m_probes.begin();
+				it != m_probes.end();
+				++it) {
+			if (it->m_fd >= 0)
+				close(it->m_fd);
+		}
+
+		for (GroupList_t::iterator it = m_groups.begin();
+				it != m_groups.end();
+				++it) {
+			if (it->m_leader >= 0)
+				close(it->m_leader);
+		}
+	}
+
+	int registerBreakpoint(unsigned long addr)
+	{
+		if (addr == 0)
+			return -1;
+
+		// Shared CUs, or lazy arming and the line itself
+		AddrToProbeMap_t::const_iterator it = m_addrToProbe.find(addr);
+
+		if (it != m_addrToProbe.end())
+			return it->second;
+
+		m_addrToProbe[addr] = m_probes.size();
+		m_probes.push_back(Probe(addr));
+
+		return m_probes.size() - 1;
+	}
+
+	void clearBreakpoints(const std::vector<uint64_t> &addrs)
+	{
+		for (std::vector<uint64_t>::const_iterator it = addrs.begin();
+				it != addrs.end();
+				++it) {
+			AddrToProbeMap_t::iterator pit = m_addrToProbe.find(*it);
+
+			if (pit == m_addrToProbe.end())
+				continue;
+
+			removeProbe(m_probes[pit->second]);
+		}
+	}
+
+	bool start(IEventListener &listener, const std::string &executable)
+	{
+		size_t sz;
+		char *type;
+
+		m_listener = &listener;
+		m_executable = executable;
+
+		type = (char *)read_file(&sz, "%s", UPROBE_TYPE_PATH);
+		if (!type) {
+			error("uprobes are not supported by this kernel");
+			return false;
+		}
+		m_uprobeType = (int)string_to_integer(trim_string(std::string(type, sz)));
+		free(type);
+
+		// One file descriptor per probe
+		struct rlimit rl;
+
+		if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+			rl.rlim_cur = rl.rlim_max;
+			setrlimit(RLIMIT_NOFILE, &rl);
+		}
+
+		// Probes are set up on the first continueExecution(), when all addresses are known
+		return true;
+	}
+
+	bool continueExecution()
+	{
+		if (!m_started) {
+			m_started = true;
+
+			if (!launch()) {
+				m_listener->onEvent(Event(ev_error, -1));
+
+				return false;
+			}
+
+			return true;
+		}
+
+		Event ev(ev_error, -1);
+		bool done = false;
+
+		if (m_attached) {
+			if (::kill(m_child, 0) < 0 && errno == ESRCH) {
+				ev = Event(ev_exit_first_process, 0);
+				done = true;
+			}
+		} else {
+			int status;
+			pid_t who = waitpid(m_child, &status, WNOHANG);
+
+			if (who != 0) {
+				if (who > 0 && WIFEXITED(status))
+					ev = Event(ev_exit_first_process, WEXITSTATUS(status));
+				else if (who > 0 && WIFSIGNALED(status))
+					ev = Event(ev_signal_exit, WTERMSIG(status));
+				done = true;
+			}
+		}
+
+		// After the exit check, so that the last hits are included
+		readCounts();
+
+		if (!done) {
+			msleep(20);
+
+			return true;
+		}
+
+		m_listener->onEvent(ev);
+		m_child = -1;
+
+		return false;
+	}
+
+	void kill(int sig)
+	{
+		if (m_child > 0)
+			::kill(m_child, sig);
+	}
+
+private:
+	enum
+	{
+		// The kernel limits the read() data of a group to 16KB
+		probesPerGroup = 512,
+	};
+
+	class Probe
+	{
+	public:
+		Probe(unsigned long addr) :
+			m_addr(addr), m_fd(-1), m_group(0), m_hit(false)
+		{
+		}
+
+		unsigned long m_addr;
+		int m_fd;
+		unsigned int m_group;
+		bool m_hit; // Or cleared
+	};
+	typedef std::vector<Probe> ProbeList_t;
+
+	class Group
+	{
+	public:
+		Group(int leader) :
+			m_leader(leader), m_size(0), m_left(0)
+		{
+		}
+
+		int m_leader; // Not a probe
+		unsigned int m_size;
+		unsigned int m_left; // Not yet hit
+	};
+	typedef std::vector<Group> GroupList_t;
+	typedef std::unordered_map<uint64_t, unsigned int> IdToProbeMap_t;
+	typedef std::unordered_map<uint64_t, unsigned int> AddrToProbeMap_t;
+
+	bool launch()
+	{
+		unsigned int pid = IConfiguration::getInstance().keyAsInt("attach-pid");
+		int fds[2] = {-1, -1};
+
+		if (!m_modules.parse(m_parser, m_executable)) {
+			error("Can't read %s", m_executable.c_str());
+			return false;
+		}
+
+		if (pid != 0) {
+			// The events would only follow threads created from now on
+			if (countThreads(pid) > 1) {
+				error("--uprobes can't attach to the multi-threaded process %u", pid);
+				return false;
+			}
+
+			m_child = pid;
+			m_attached = true;
+		} else {
+			// Held before exec until the probes have been set up
+			if (pipe(fds) < 0)
+				return false;
+
+			m_child = fork();
+			if (m_child == 0) {
+				char *const *argv = (char *const *)IConfiguration::getInstance().getArgv();
+				char c;
+
+				close(fds[1]);
+				if (read(fds[0], &c, 1) != 1)
+					_exit(127);
+				close(fds[0]);
+
+				execv(m_executable.c_str(), argv);
+
+				perror("execv");
+				_exit(127);
+			} else if (m_child < 0) {
+				perror("fork");
+
+				return false;
+			}
+			close(fds[0]);
+		}
+
+		bool res = setupProbes();
+
+		if (!m_attached) {
+			// Closing the pipe without writing makes the child exit
+			if (res && write(fds[1], "x", 1) != 1)
+				res = false;
+			close(fds[1]);
+		}
+
+		return res;
+	}
+
+	bool setupProbes()
+	{
+		unsigned int n = 0;
+
+		for (unsigned int i = 0; i < m_probes.size(); i++) {
+			Probe &cur = m_probes[i];
+			uint64_t offset;
+
+			if (!m_modules.getFileOffset(cur.m_addr, &offset))
+				continue;
+
+			if (cur.m_hit)
+				continue;
+
+			const std::string &path = m_modules.getModules()[StaticModules::getModuleIndex(cur.m_addr)].m_path;
+			bool newGroup = m_groups.empty() || m_groups.back().m_size == probesPerGroup;
+			struct perf_event_attr attr;
+
+			if (newGroup) {
+				int leader = openLeader();
+
+				if (leader < 0) {
+					if (n == 0) {
+						error("Can't setup uprobe group: %s (check /proc/sys/kernel/perf_event_paranoid)",
+								strerror(errno));
+						return false;
+					}
+					warning("Can only setup %u of %zu uprobes: %s", n, m_probes.size(),
+							strerror(errno));
+					break;
+				}
+				m_groups.push_back(Group(leader));
+			}
+
+			memset(&attr, 0, sizeof(attr));
+			attr.size = sizeof(attr);
+			attr.type = m_uprobeType;
+			attr.config1 = (uint64_t)(unsigned long)path.c_str(); // uprobe_path
+			attr.config2 = offset; // probe_offset
+			attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_ID;
+			attr.inherit = 1;
+
+			// Members follow the leader
+			cur.m_fd = perfEventOpen(&attr, m_child, m_groups.back().m_leader);
+			if (cur.m_fd < 0) {
+				if (n == 0) {
+					error("Can't setup uprobe: %s (check /proc/sys/kernel/perf_event_paranoid)",
+							strerror(errno));
+					return false;
+				}
+				// Typically out of file descriptors
+				warning("Can only setup %u of %zu uprobes: %s", n, m_probes.size(),
+						strerror(errno));
+				break;
+			}
+
+			uint64_t id;
+
+			if (ioctl(cur.m_fd, PERF_EVENT_IOC_ID, &id) < 0)
+				return false;
+
+			cur.m_group = m_groups.size() - 1;
+			m_groups.back().m_size++;
+			m_groups.back().m_left++;
+
+			m_idToProbe[id] = i;
+			n++;
+		}
+
+		kcov_debug(ENGINE_MSG, "UPROBE %u probes in %zu groups for %d\n",
+				n, m_groups.size(), m_child);
+
+		return true;
+	}
+
+	// A dummy event which the probes of a group are read through
+	int openLeader()
+	{
+		struct perf_event_attr attr;
+
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_SOFTWARE;
+		attr.config = PERF_COUNT_SW_DUMMY;
+		attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_ID;
+		attr.inherit = 1;
+		if (!m_attached) {
+			attr.disabled = 1;
+			attr.enable_on_exec = 1;
+		}
+
+		return perfEventOpen(&attr, m_child, -1);
+	}
+
+	void readCounts()
+	{
+		// { nr, { value, id }[nr] }, with the leader first
+		uint64_t buf[1 + 2 * (probesPerGroup + 1)];
+
+		for (GroupList_t::iterator it = m_groups.begin();
+				it != m_groups.end();
+				++it) {
+			if (it->m_left == 0)
+				continue;
+
+			ssize_t r = read(it->m_leader, buf, sizeof(buf));
+			if (r < (ssize_t)sizeof(uint64_t))
+				continue;
+
+			uint64_t nr = buf[0];
+
+			if (nr > (r / sizeof(uint64_t) - 1) / 2)
+				nr = (r / sizeof(uint64_t) - 1) / 2;
+
+			for (uint64_t i = 0; i < nr; i++) {
+				if (buf[1 + 2 * i] == 0)
+					continue;
+
+				reportHit(buf[2 + 2 * i]);
+			}
+		}
+	}
+
+	/*
+	 * One-shot: Closing the event removes the uprobe from the program
+	 * (and from the children it was inherited by), and the leader goes
+	 * with the last probe of the group.
+	 */
+	void removeProbe(Probe &probe)
+	{
+		if (probe.m_hit)
+			return;
+		probe.m_hit = true;
+
+		if (probe.m_fd < 0)
+			return;
+
+		Group &group = m_groups[probe.m_group];
+
+		close(probe.m_fd);
+		probe.m_fd = -1;
+
+		group.m_left--;
+		if (group.m_left == 0) {
+			close(group.m_leader);
+			group.m_leader = -1;
+		}
+	}
+
+	void reportHit(uint64_t id)
+	{
+		IdToProbeMap_t::iterator it = m_idToProbe.find(id);
+
+		if (it == m_idToProbe.end())
+			return;
+
+		Probe &cur = m_probes[it->second];
+
+		if (cur.m_hit)
+			return;
+
+		removeProbe(cur);
+
+		m_listener->onEvent(Event(ev_breakpoint, -1, cur.m_addr));
+	}
+
+	IFileParser &m_parser;
+	IEventListener *m_listener;
+	std::string m_executable;
+	pid_t m_child;
+	bool m_attached;
+	bool m_started;
+
+	StaticModules m_modules;
+	ProbeList_t m_probes;
+	GroupList_t m_groups;
+	IdToProbeMap_t m_idToProbe;
+	AddrToProbeMap_t m_addrToProbe;
+	int m_uprobeType;
+};
+
+
+class UprobeEngineCreator : public IEngineFactory::IEngineCreator
+{
+public:
+	UprobeEngineCreator() :
+		m_warned(false)
+	{
+	}
+
+	virtual ~UprobeEngineCreator()
+	{
+	}
+
+	virtual IEngine *create(IFileParser &parser)
+	{
+		return new UprobeEngine(parser);
+	}
+
+	unsigned int matchFile(const std::string &filename, uint8_t *data, size_t dataSize)
+	{
+		IConfiguration &conf = IConfiguration::getInstance();
+
+		if (!conf.keyAsInt("uprobes"))
+			return match_none;
+
+		// The threads which already exist can't be probed
+		unsigned int pid = conf.keyAsInt("attach-pid");
+
+		if (pid != 0 && countThreads(pid) > 1) {
+			if (!m_warned)
+				warning("uprobes can't follow the threads of process %u, falling back to ptrace", pid);
+			m_warned = true;
+
+			return match_none;
+		}
+
+		// Only ELF binaries (not scripts)
+		if (dataSize < SELFMAG || memcmp(data, ELFMAG, SELFMAG) != 0)
+			return match_none;
+
+#if defined(__NR_perf_event_open)
+		if (access(UPROBE_TYPE_PATH, R_OK) == 0)
+			return match_perfect;
+#endif
+
+		if (!m_warned)
+			warning("uprobes are not available, falling back to ptrace");
+		m_warned = true;
+
+		return match_none;
+	}
+
+private:
+	bool m_warned;
+};
+
+static UprobeEngineCreator g_uprobeEngineCreator;
@@ -32,6 +32,22 @@ namespace kcov
 			virtual void onTick() = 0;
 		};
 
+		class IBreakpointFilter
+		{
+		public:
+			/**
+			 * Check if a breakpoint isn't needed for an address, e.g.,
+			 * because it's already covered.
+			 *
+			 * @param file the source file
+			 * @param lineNr the line number in @a file
+			 * @param addr the address of the line
+			 *
+			 * @return true if no breakpoint should be set
+			 */
+			virtual bool skipBreakpoint(const std::string &file, unsigned int lineNr, uint64_t addr) = 0;
+		};
+
 		virtual ~ICollector() {};
 
 		/**
@@ -46,6 +62,11 @@ namespace kcov
 		 */
 		virtual void registerEventTickListener(IEventTickListener &listener) = 0;
 
+		/**
+		 * Register a filter for breakpoints
+		 */
+		virtual void registerBreakpointFilter(IBreakpointFilter &filter) = 0;
+
 		/**
 		 * Run a program and collect coverage data
 		 *
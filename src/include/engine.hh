@@ -6,6 +6,7 @@
 #include <stdlib.h>
 
 #include <string>
+#include <vector>
 
 namespace kcov
 {
@@ -61,6 +62,15 @@ namespace kcov
 		 */
 		virtual int registerBreakpoint(unsigned long addr) = 0;
 
+		/**
+		 * Remove breakpoints which are no longer needed, e.g., because
+		 * another address on the same line has been hit. Engines which
+		 * can't remove breakpoints ignore this.
+		 *
+		 * @param addrs the addresses to remove breakpoints from
+		 */
+		virtual void clearBreakpoints(const std::vector<uint64_t> &addrs) {}
+
 		/**
 		 * Fork a new process and attach to it
 		 *
@@ -10,8 +10,7 @@
 #include <vector>
 
 #include <utils.hh>
-
-struct phdr_data_entry;
+#include <phdr_data.h>
 
 namespace kcov
 {
@@ -63,6 +62,21 @@ namespace kcov
 					uint64_t addr) = 0;
 		};
 
+		/**
+		 * Listener for functions (with a contiguous address range)
+		 *
+		 * Called before the lines of the same file.
+		 */
+		class IFunctionListener
+		{
+		public:
+			/**
+			 * @param start the entry address of the function
+			 * @param end the address after the last instruction
+			 */
+			virtual void onFunction(uint64_t start, uint64_t end) = 0;
+		};
+
 		/**
 		 * Listener for added files (typically an ELF binary)
 		 */
@@ -107,6 +121,15 @@ namespace kcov
 		 */
 		virtual void registerLineListener(ILineListener &listener) = 0;
 
+		/**
+		 * Register a listener for functions.
+		 *
+		 * Parsers which don't know about functions ignore this.
+		 *
+		 * @param listener the listener
+		 */
+		virtual void registerFunctionListener(IFunctionListener &listener) {}
+
 		/**
 		 * Register a listener for coveree files.
 		 *
@@ -123,6 +146,25 @@ namespace kcov
 		 */
 		virtual bool parse() = 0;
 
+		typedef std::vector<struct phdr_data_entry *> SolibList_t;
+
+		/**
+		 * Add and parse several solibs, like addFile and parse for each of
+		 * them. Parsers which can parse them concurrently do so, but the
+		 * listeners are still called in the order of the list.
+		 *
+		 * @param solibs the solibs, with base address data
+		 */
+		virtual void parseSolibs(const SolibList_t &solibs)
+		{
+			for (SolibList_t::const_iterator it = solibs.begin();
+					it != solibs.end();
+					++it) {
+				addFile((*it)->name, *it);
+				parse();
+			}
+		}
+
 		/**
 		 * Get the checksum of the main file (not solibs)
 		 *
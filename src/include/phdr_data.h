@@ -2,11 +2,14 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <sys/types.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+#define PHDR_DATA_UNLOADED 1 // The object has been removed
+
 struct phdr_data_segment
 {
 	unsigned long paddr;
@@ -17,33 +20,80 @@ struct phdr_data_segment
 struct phdr_data_entry
 {
 	char name[1024];
+	uint32_t flags;
 	uint32_t n_segments;
 
 	// "Reasonable" max
 	struct phdr_data_segment segments[64];
 };
 
+/*
+ * The unpacked solib data in kcov: The objects which have been loaded or
+ * unloaded since the last message.
+ */
 struct phdr_data
 {
 	uint32_t magic;
 	uint32_t version;
 	unsigned long relocation; // for PIE
+	int32_t pid; // The process which has loaded them, or 0 if not known
 	uint32_t n_entries;
 
 	struct phdr_data_entry entries[];
 };
 
+/*
+ * On the wire (from the preloaded library), a message is a header followed
+ * by variable-length records, which are padded to 8 bytes.
+ */
+struct phdr_data_header
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size; // Of the whole message
+	uint32_t n_records;
+	int32_t pid; // The sender
+	uint32_t reserved;
+	uint64_t relocation;
+};
+
+struct phdr_data_record
+{
+	uint32_t size; // Including the segments, name and padding
+	uint16_t flags;
+	uint16_t n_segments;
+
+	struct phdr_data_segment segments[];
+
+	// Followed by the NUL-terminated name
+};
+
+/* A message being built, in a growing buffer */
+struct phdr_data_message
+{
+	uint8_t *data;
+	size_t size;
+	size_t allocated;
+};
+
 struct dl_phdr_info;
 
-struct phdr_data *phdr_data_new(size_t size);
+void phdr_data_message_init(struct phdr_data_message *msg, unsigned long relocation);
+
+int phdr_data_message_add(struct phdr_data_message *msg, struct dl_phdr_info *info);
 
-void phdr_data_add(struct phdr_data *p, struct dl_phdr_info *info);
+int phdr_data_message_add_unloaded(struct phdr_data_message *msg, const char *name);
 
-void *phdr_data_marshal(struct phdr_data *p, size_t *out_sz);
+void phdr_data_message_free(struct phdr_data_message *msg);
 
-void phdr_data_free(struct phdr_data *p);
+/*
+ * Get the size of the message at the start of the data. Returns 0 if more
+ * data is needed to tell, or -1 if it's broken.
+ */
+ssize_t phdr_data_message_size(const void *data, size_t size);
 
-struct phdr_data *phdr_data_unmarshal(void *p);
+/* Unpack a complete message (allocated with malloc), NULL if it's broken */
+struct phdr_data *phdr_data_unmarshal(const void *data, size_t size);
 
 #ifdef __cplusplus
 }
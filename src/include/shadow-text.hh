@@ -0,0 +1,92 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+namespace kcov
+{
+	/**
+	 * Singleton store with copies of the executable sections of loaded
+	 * modules, as they are on disk, at their run-time addresses.
+	 *
+	 * The engines use this to get the original instructions for breakpoints
+	 * without reading them from the traced process. Since processes can
+	 * have different modules at the same address, e.g., after a dlopen in
+	 * a forked child, a region is only valid for the process which has
+	 * verified it.
+	 */
+	class IShadowText
+	{
+	public:
+		enum LookupResult
+		{
+			SHADOW_MISSING,    //< Not (fully) covered by the store, or verified by another process
+			SHADOW_UNVERIFIED, //< Data copied, but not checked against any process yet
+			SHADOW_VALID,      //< Data copied and the region is known to match the process
+		};
+
+		virtual ~IShadowText()
+		{
+		}
+
+		/**
+		 * Add a section of a module.
+		 *
+		 * Previous regions overlapping the new one are removed.
+		 *
+		 * @param module the module (file) name
+		 * @param loadBase the load base of the module
+		 * @param addr the run-time address of the section
+		 * @param data the on-disk section contents (copied)
+		 * @param size the size of the section
+		 * @param trusted false if the text might be modified at load time,
+		 *        e.g., for modules with text relocations
+		 */
+		virtual void addRegion(const std::string &module, unsigned long loadBase,
+				unsigned long addr, const void *data, size_t size, bool trusted) = 0;
+
+		/**
+		 * Copy data from the store.
+		 *
+		 * @param pid the process the data is for
+		 * @param addr the run-time address to lookup
+		 * @param dst the destination buffer
+		 * @param size the number of bytes to copy
+		 *
+		 * @return SHADOW_MISSING if the range is not within a trusted region
+		 *         or the region was verified by another process, otherwise if
+		 *         the region has been verified or not
+		 */
+		virtual enum LookupResult lookup(pid_t pid, unsigned long addr, void *dst, size_t size) = 0;
+
+		/**
+		 * Copy a whole region, to compare it against a process.
+		 *
+		 * @param addr an address in the region
+		 * @param start returns the start address of the region
+		 * @param data returns the region contents
+		 *
+		 * @return false if there is no trusted region at @a addr
+		 */
+		virtual bool getRegion(unsigned long addr, unsigned long &start, std::vector<uint8_t> &data) = 0;
+
+		/**
+		 * Record the result of comparing a whole region against a process.
+		 *
+		 * @param pid the process which was compared
+		 * @param addr an address in the region which was compared
+		 * @param matches true if the process memory matched the store
+		 */
+		virtual void setVerified(pid_t pid, unsigned long addr, bool matches) = 0;
+
+		/**
+		 * Singleton getter.
+		 *
+		 * @return a reference to the shadow text singleton
+		 */
+		static IShadowText &getInstance();
+	};
+}
@@ -3,6 +3,10 @@
 #include <engine.hh>
 #include <collector.hh>
 
+#include <sys/types.h>
+
+struct phdr_data;
+
 namespace kcov
 {
 	class ISolibHandler
@@ -17,6 +21,12 @@ namespace kcov
 
 	ISolibHandler &createSolibHandler(IFileParser &parser, ICollector &collector);
 
-	// Wait for the solib thread to finish parsing the solib data
-	void blockUntilSolibDataRead();
+	// Make sure that the solib data which has been written so far is queued (from the tracer)
+	void readSolibData();
+
+	// Queue solib data from another source than the preloaded library (free:d when handled)
+	void queueSolibData(struct phdr_data *p);
+
+	// The process which has loaded the solibs being parsed, or 0 when not parsing solibs
+	pid_t getSolibOwner();
 }
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <stddef.h>
+
+namespace kcov
+{
+	/**
+	 * Lock-free single-producer, single-consumer ring buffer.
+	 *
+	 * push() may only be called from one thread and pop() from one
+	 * (other) thread.
+	 */
+	template<typename T>
+	class SpscRing
+	{
+	public:
+		/**
+		 * @param order log2 of the number of entries in the ring
+		 */
+		SpscRing(unsigned int order) :
+			m_entries(1UL << order),
+			m_mask((1UL << order) - 1),
+			m_head(0),
+			m_tail(0)
+		{
+		}
+
+		/**
+		 * Add an entry (producer side).
+		 *
+		 * @param entry the entry to add
+		 *
+		 * @return false if the ring is full
+		 */
+		bool push(const T &entry)
+		{
+			size_t head = m_head.load(std::memory_order_relaxed);
+
+			if (head - m_tail.load(std::memory_order_acquire) == m_entries.size())
+				return false;
+
+			m_entries[head & m_mask] = entry;
+			m_head.store(head + 1, std::memory_order_release);
+
+			return true;
+		}
+
+		/**
+		 * Remove an entry (consumer side).
+		 *
+		 * @param out the removed entry
+		 *
+		 * @return false if the ring is empty
+		 */
+		bool pop(T &out)
+		{
+			size_t tail = m_tail.load(std::memory_order_relaxed);
+
+			if (tail == m_head.load(std::memory_order_acquire))
+				return false;
+
+			out = m_entries[tail & m_mask];
+			m_tail.store(tail + 1, std::memory_order_release);
+
+			return true;
+		}
+
+		bool empty() const
+		{
+			return m_tail.load(std::memory_order_acquire) == m_head.load(std::memory_order_acquire);
+		}
+
+	private:
+		std::vector<T> m_entries;
+		size_t m_mask;
+
+		// Written by the producer and the consumer respectively
+		std::atomic<size_t> m_head;
+		std::atomic<size_t> m_tail;
+	};
+}
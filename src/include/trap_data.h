@@ -0,0 +1,110 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define KCOV_TRAP_MAGIC   0x6b747270 /* "ktrp" */
+#define KCOV_TRAP_VERSION 2
+
+/*
+ * Shared between kcov and the preloaded library in trap handler mode: kcov
+ * fills in the breakpoint table (sorted by address), and the SIGTRAP handler
+ * in the traced process restores the original instruction and sets the
+ * bit for the breakpoint in the hit bitmap.
+ *
+ * The library sets ready when the handler is installed, and forces a trap
+ * at which kcov detaches. Until then, the breakpoints it hits while
+ * setting up (e.g., in libc) are still handled by kcov.
+ */
+struct trap_data_entry
+{
+	unsigned long addr;
+	uint32_t orig_byte;
+	uint32_t bit; // In the hit bitmap
+};
+
+struct trap_data
+{
+	uint32_t magic;
+	uint32_t version;
+	int32_t pid; // The process the table is valid for
+	uint32_t n_entries;
+	uint32_t ready; // Set by the library
+	uint32_t reserved;
+
+	struct trap_data_entry entries[];
+
+	// Followed by the hit bitmap, see trap_data_bitmap()
+};
+
+static inline size_t trap_data_bitmap_words(uint32_t n_entries)
+{
+	return (n_entries + 31) / 32;
+}
+
+static inline size_t trap_data_size(uint32_t n_entries)
+{
+	return sizeof(struct trap_data) +
+			n_entries * sizeof(struct trap_data_entry) +
+			trap_data_bitmap_words(n_entries) * sizeof(uint32_t);
+}
+
+static inline uint32_t *trap_data_bitmap(struct trap_data *p)
+{
+	return (uint32_t *)&p->entries[p->n_entries];
+}
+
+
+#define KCOV_STARTUP_TRAP_MAGIC   0x6b696e73 /* "kins" */
+#define KCOV_STARTUP_TRAP_VERSION 1
+
+/*
+ * Trap handler mode armed at startup: kcov lists the breakpoints as
+ * offsets from the load base of each module, and the preloaded library
+ * sets them up itself when the program starts. The hit bitmap has one bit
+ * per offset.
+ */
+struct startup_trap_module
+{
+	char name[1024]; // Real path
+	uint32_t first_entry;
+	uint32_t n_entries;
+};
+
+struct startup_trap_data
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t n_modules;
+	uint32_t n_entries;
+
+	struct startup_trap_module modules[];
+
+	// Followed by the offsets (sorted per module) and the hit bitmap
+};
+
+static inline size_t startup_trap_data_size(uint32_t n_modules, uint32_t n_entries)
+{
+	return sizeof(struct startup_trap_data) +
+			n_modules * sizeof(struct startup_trap_module) +
+			n_entries * sizeof(unsigned long) +
+			trap_data_bitmap_words(n_entries) * sizeof(uint32_t);
+}
+
+static inline unsigned long *startup_trap_data_offsets(struct startup_trap_data *p)
+{
+	return (unsigned long *)&p->modules[p->n_modules];
+}
+
+static inline uint32_t *startup_trap_data_bitmap(struct startup_trap_data *p)
+{
+	return (uint32_t *)&startup_trap_data_offsets(p)[p->n_entries];
+}
+
+#ifdef __cplusplus
+}
+#endif
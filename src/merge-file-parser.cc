@@ -279,6 +279,10 @@ public:
 	{
 	}
 
+	virtual void registerBreakpointFilter(ICollector::IBreakpointFilter &filter)
+	{
+	}
+
 	virtual int run(const std::string &filename)
 	{
 		// Not used
@@ -0,0 +1,425 @@
+#include "dwarf-cache.hh"
+
+#include <utils.hh>
+#include <filter.hh>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace kcov;
+
+#define DWARF_CACHE_MAGIC   0x6b636477 /* "kcdw" */
+#define DWARF_CACHE_VERSION 2
+
+#define DWARF_CACHE_NO_CU         0xffffffff /* Function outside of any CU */
+#define DWARF_CACHE_UNKNOWN_FILES 0xffffffff /* The CU is never filtered out */
+
+/*
+ * The file is the header, the functions, the lines, the CUs, the name
+ * indices of the files of the CUs, the offsets of the names and then the
+ * NUL-terminated names.
+ */
+struct dwarf_cache_header
+{
+	uint32_t magic;
+	uint32_t version;
+	uint64_t size; // Of the whole file
+	uint32_t n_functions;
+	uint32_t n_lines;
+	uint32_t n_cus;
+	uint32_t n_cu_files;
+	uint32_t n_names;
+	uint32_t names_size;
+};
+
+struct dwarf_cache_function
+{
+	uint64_t start;
+	uint64_t end;
+	uint32_t cu;
+	uint32_t reserved;
+};
+
+struct dwarf_cache_cu
+{
+	uint32_t first_file;
+	uint32_t n_files;
+};
+
+struct dwarf_cache_line
+{
+	uint64_t addr;
+	uint32_t name;
+	uint32_t line;
+};
+
+// mkdir -p
+static void createDirectory(const std::string &path)
+{
+	size_t pos = 0;
+
+	while (pos != std::string::npos) {
+		pos = path.find('/', pos + 1);
+
+		(void)mkdir(path.substr(0, pos).c_str(), 0755);
+	}
+}
+
+DwarfCache::DwarfCache(const std::string &directory, const std::string &key) :
+		m_path(fmt("%s/%s.lines", directory.c_str(), key.c_str())),
+		m_directory(directory),
+		m_key(key),
+		m_data(NULL),
+		m_size(0),
+		m_mapped(false)
+{
+}
+
+DwarfCache::~DwarfCache()
+{
+	unmap();
+}
+
+bool DwarfCache::load()
+{
+	struct stat st;
+	void *p;
+	int fd;
+
+	unmap();
+
+	fd = open(m_path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct dwarf_cache_header)) {
+		close(fd);
+		return false;
+	}
+
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return false;
+
+	m_data = (const uint8_t *)p;
+	m_size = st.st_size;
+	m_mapped = true;
+
+	if (!validate(m_data, m_size)) {
+		kcov_debug(ELF_MSG, "Broken DWARF cache entry %s\n", m_path.c_str());
+		unmap();
+
+		return false;
+	}
+
+	kcov_debug(ELF_MSG, "DWARF cache hit for %s\n", m_key.c_str());
+
+	return true;
+}
+
+bool DwarfCache::store()
+{
+	struct dwarf_cache_header hdr;
+	size_t namesSize = 0;
+
+	for (std::vector<std::string>::const_iterator it = m_names.begin();
+			it != m_names.end();
+			++it)
+		namesSize += it->size() + 1;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = DWARF_CACHE_MAGIC;
+	hdr.version = DWARF_CACHE_VERSION;
+	hdr.n_functions = m_functions.size();
+	hdr.n_lines = m_lines.size();
+	hdr.n_cus = m_cus.size();
+	hdr.n_cu_files = m_cuFiles.size();
+	hdr.n_names = m_names.size();
+	hdr.names_size = namesSize;
+	hdr.size = sizeof(hdr) +
+			m_functions.size() * sizeof(struct dwarf_cache_function) +
+			m_lines.size() * sizeof(struct dwarf_cache_line) +
+			m_cus.size() * sizeof(struct dwarf_cache_cu) +
+			m_cuFiles.size() * sizeof(uint32_t) +
+			m_names.size() * sizeof(uint32_t) +
+			namesSize;
+
+	unmap();
+
+	uint8_t *data = (uint8_t *)xmalloc(hdr.size);
+	uint8_t *p = data;
+
+	memcpy(p, &hdr, sizeof(hdr));
+	p += sizeof(hdr);
+
+	for (std::vector<Function>::const_iterator it = m_functions.begin();
+			it != m_functions.end();
+			++it) {
+		struct dwarf_cache_function cur;
+
+		memset(&cur, 0, sizeof(cur));
+		cur.start = it->m_start;
+		cur.end = it->m_end;
+		cur.cu = it->m_cu;
+		memcpy(p, &cur, sizeof(cur));
+		p += sizeof(cur);
+	}
+
+	for (std::vector<Line>::const_iterator it = m_lines.begin();
+			it != m_lines.end();
+			++it) {
+		struct dwarf_cache_line cur;
+
+		cur.addr = it->m_addr;
+		cur.name = it->m_name;
+		cur.line = it->m_line;
+		memcpy(p, &cur, sizeof(cur));
+		p += sizeof(cur);
+	}
+
+	for (std::vector<Cu>::const_iterator it = m_cus.begin();
+			it != m_cus.end();
+			++it) {
+		struct dwarf_cache_cu cur;
+
+		cur.first_file = it->m_firstFile;
+		cur.n_files = it->m_files;
+		memcpy(p, &cur, sizeof(cur));
+		p += sizeof(cur);
+	}
+
+	if (!m_cuFiles.empty()) {
+		memcpy(p, &m_cuFiles[0], m_cuFiles.size() * sizeof(uint32_t));
+		p += m_cuFiles.size() * sizeof(uint32_t);
+	}
+
+	uint32_t offset = 0;
+
+	for (std::vector<std::string>::const_iterator it = m_names.begin();
+			it != m_names.end();
+			++it) {
+		memcpy(p, &offset, sizeof(offset));
+		p += sizeof(offset);
+		offset += it->size() + 1;
+	}
+
+	for (std::vector<std::string>::const_iterator it = m_names.begin();
+			it != m_names.end();
+			++it) {
+		memcpy(p, it->c_str(), it->size() + 1);
+		p += it->size() + 1;
+	}
+
+	// Replayed from memory, whatever happens with the file
+	m_data = data;
+	m_size = hdr.size;
+	m_mapped = false;
+
+	createDirectory(m_directory);
+
+	std::string tmpPath = fmt("%s/.%s.XXXXXX", m_directory.c_str(), m_key.c_str());
+	int fd = mkstemp(&tmpPath[0]);
+
+	if (fd < 0) {
+		kcov_debug(ELF_MSG, "Can't create a DWARF cache entry in %s\n", m_directory.c_str());
+		return false;
+	}
+
+	bool out = true;
+
+	for (size_t written = 0; written < m_size; ) {
+		ssize_t r = write(fd, m_data + written, m_size - written);
+
+		if (r <= 0) {
+			out = false;
+			break;
+		}
+		written += r;
+	}
+	close(fd);
+
+	if (out)
+		out = rename(tmpPath.c_str(), m_path.c_str()) == 0;
+	if (!out)
+		unlink(tmpPath.c_str());
+
+	return out;
+}
+
+void DwarfCache::replay(IFileParser::ILineListener &lineListener,
+		IFileParser::IFunctionListener *functionListener, IFilter *filter)
+{
+	if (!m_data)
+		return;
+
+	const struct dwarf_cache_header *hdr = (const struct dwarf_cache_header *)m_data;
+	const struct dwarf_cache_function *functions = (const struct dwarf_cache_function *)(hdr + 1);
+	const struct dwarf_cache_line *lines = (const struct dwarf_cache_line *)(functions + hdr->n_functions);
+	const struct dwarf_cache_cu *cus = (const struct dwarf_cache_cu *)(lines + hdr->n_lines);
+	const uint32_t *cuFiles = (const uint32_t *)(cus + hdr->n_cus);
+	const uint32_t *offsets = cuFiles + hdr->n_cu_files;
+	const char *names = (const char *)(offsets + hdr->n_names);
+
+	// Only create the strings, and filter them, once
+	std::vector<std::string> nameList;
+	std::vector<bool> included;
+
+	for (uint32_t i = 0; i < hdr->n_names; i++) {
+		nameList.push_back(std::string(names + offsets[i]));
+		included.push_back(!filter || filter->runFilters(filter->mangleSourcePath(nameList.back())));
+	}
+
+	// As for libdw, the functions of CUs where all files are filtered out are skipped
+	std::vector<bool> cuIncluded;
+
+	for (uint32_t i = 0; functionListener && i < hdr->n_cus; i++) {
+		bool cur = cus[i].n_files == DWARF_CACHE_UNKNOWN_FILES;
+
+		for (uint32_t j = 0; !cur && j < cus[i].n_files; j++)
+			cur = included[cuFiles[cus[i].first_file + j]];
+		cuIncluded.push_back(cur);
+	}
+
+	for (uint32_t i = 0; functionListener && i < hdr->n_functions; i++) {
+		if (functions[i].cu == DWARF_CACHE_NO_CU || cuIncluded[functions[i].cu])
+			functionListener->onFunction(functions[i].start, functions[i].end);
+	}
+
+	for (uint32_t i = 0; i < hdr->n_lines; i++) {
+		if (included[lines[i].name])
+			lineListener.onLine(nameList[lines[i].name], lines[i].line, lines[i].addr);
+	}
+}
+
+void DwarfCache::onLine(const std::string &file, unsigned int lineNr, uint64_t addr)
+{
+	Line cur;
+
+	cur.m_addr = addr;
+	cur.m_name = lookupName(file);
+	cur.m_line = lineNr;
+	m_lines.push_back(cur);
+}
+
+void DwarfCache::onFunction(uint64_t start, uint64_t end)
+{
+	Function cur;
+
+	cur.m_start = start;
+	cur.m_end = end;
+	cur.m_cu = m_cus.empty() ? DWARF_CACHE_NO_CU : m_cus.size() - 1;
+	m_functions.push_back(cur);
+}
+
+void DwarfCache::onCu(const std::vector<std::string> *files)
+{
+	Cu cur;
+
+	cur.m_firstFile = m_cuFiles.size();
+	cur.m_files = DWARF_CACHE_UNKNOWN_FILES;
+
+	if (files) {
+		for (std::vector<std::string>::const_iterator it = files->begin();
+				it != files->end();
+				++it)
+			m_cuFiles.push_back(lookupName(*it));
+		cur.m_files = files->size();
+	}
+	m_cus.push_back(cur);
+}
+
+// The index of a name, added if it's new
+uint32_t DwarfCache::lookupName(const std::string &file)
+{
+	NameMap_t::const_iterator it = m_nameMap.find(file);
+
+	if (it != m_nameMap.end())
+		return it->second;
+
+	uint32_t out = m_names.size();
+
+	m_names.push_back(file);
+	m_nameMap[file] = out;
+
+	return out;
+}
+
+// Everything must be within the file, since it's used without checks
+bool DwarfCache::validate(const uint8_t *data, size_t size)
+{
+	const struct dwarf_cache_header *hdr = (const struct dwarf_cache_header *)data;
+
+	if (size < sizeof(*hdr) ||
+			hdr->magic != DWARF_CACHE_MAGIC || hdr->version != DWARF_CACHE_VERSION ||
+			hdr->size != size)
+		return false;
+
+	uint64_t expected = sizeof(*hdr) +
+			(uint64_t)hdr->n_functions * sizeof(struct dwarf_cache_function) +
+			(uint64_t)hdr->n_lines * sizeof(struct dwarf_cache_line) +
+			(uint64_t)hdr->n_cus * sizeof(struct dwarf_cache_cu) +
+			(uint64_t)hdr->n_cu_files * sizeof(uint32_t) +
+			(uint64_t)hdr->n_names * sizeof(uint32_t) +
+			hdr->names_size;
+
+	if (expected != size)
+		return false;
+
+	const struct dwarf_cache_function *functions = (const struct dwarf_cache_function *)(hdr + 1);
+	const struct dwarf_cache_line *lines = (const struct dwarf_cache_line *)(functions + hdr->n_functions);
+	const struct dwarf_cache_cu *cus = (const struct dwarf_cache_cu *)(lines + hdr->n_lines);
+	const uint32_t *cuFiles = (const uint32_t *)(cus + hdr->n_cus);
+	const uint32_t *offsets = cuFiles + hdr->n_cu_files;
+	const char *names = (const char *)(offsets + hdr->n_names);
+
+	// The last name must be terminated, and the others are then as well
+	if (hdr->n_names > 0 && (hdr->names_size == 0 || names[hdr->names_size - 1] != '\0'))
+		return false;
+
+	for (uint32_t i = 0; i < hdr->n_names; i++) {
+		if (offsets[i] >= hdr->names_size)
+			return false;
+	}
+
+	for (uint32_t i = 0; i < hdr->n_lines; i++) {
+		if (lines[i].name >= hdr->n_names)
+			return false;
+	}
+
+	for (uint32_t i = 0; i < hdr->n_functions; i++) {
+		if (functions[i].cu != DWARF_CACHE_NO_CU && functions[i].cu >= hdr->n_cus)
+			return false;
+	}
+
+	for (uint32_t i = 0; i < hdr->n_cus; i++) {
+		if (cus[i].n_files == DWARF_CACHE_UNKNOWN_FILES)
+			continue;
+		if ((uint64_t)cus[i].first_file + cus[i].n_files > hdr->n_cu_files)
+			return false;
+	}
+
+	for (uint32_t i = 0; i < hdr->n_cu_files; i++) {
+		if (cuFiles[i] >= hdr->n_names)
+			return false;
+	}
+
+	return true;
+}
+
+void DwarfCache::unmap()
+{
+	if (m_mapped)
+		munmap((void *)m_data, m_size);
+	else
+		free((void *)m_data);
+
+	m_data = NULL;
+	m_size = 0;
+	m_mapped = false;
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include <file-parser.hh>
+
+#include "dwarf.hh"
+
+namespace kcov
+{
+	class IFilter;
+
+	/**
+	 * On-disk cache of the lines and functions in the debug information of
+	 * a binary, keyed by its build-id (or a hash of the file), so that
+	 * libdw isn't needed for binaries which have been seen before.
+	 *
+	 * The entries are what libdw gives, i.e., unrelocated addresses and
+	 * unmangled paths, and are read through mmap. They don't depend on the
+	 * filter: The functions are stored with the files of their CU, so that
+	 * they can be filtered like libdw does when replayed.
+	 */
+	class DwarfCache : public IFileParser::ILineListener, public IFileParser::IFunctionListener,
+		public DwarfParser::ICuListener
+	{
+	public:
+		/**
+		 * @param directory the cache directory, created if needed
+		 * @param key the build-id or file hash
+		 */
+		DwarfCache(const std::string &directory, const std::string &key);
+
+		~DwarfCache();
+
+		/**
+		 * Map the cache entry for the key.
+		 *
+		 * @return false if there is none, or it's broken
+		 */
+		bool load();
+
+		/**
+		 * Write the recorded lines and functions as the entry for the key,
+		 * and use them for replay. Written to a temporary file and renamed,
+		 * so concurrent kcov runs see either nothing or everything.
+		 *
+		 * @return true if the entry could be written
+		 */
+		bool store();
+
+		/**
+		 * Pass on the loaded or stored entry, the functions first.
+		 *
+		 * @param lineListener the listener for lines
+		 * @param functionListener the listener for functions, or NULL
+		 * @param filter if set, skip the lines of the files it filters out,
+		 * and the functions of CUs where all files are
+		 */
+		void replay(IFileParser::ILineListener &lineListener,
+				IFileParser::IFunctionListener *functionListener, IFilter *filter = NULL);
+
+		// From IFileParser::ILineListener, to record
+		void onLine(const std::string &file, unsigned int lineNr, uint64_t addr);
+
+		// From IFileParser::IFunctionListener, to record
+		void onFunction(uint64_t start, uint64_t end);
+
+		// From DwarfParser::ICuListener, to record
+		void onCu(const std::vector<std::string> *files);
+
+	private:
+		struct Function
+		{
+			uint64_t m_start;
+			uint64_t m_end;
+			uint32_t m_cu;
+		};
+
+		struct Cu
+		{
+			uint32_t m_firstFile;
+			uint32_t m_files;
+		};
+
+		struct Line
+		{
+			uint64_t m_addr;
+			uint32_t m_name;
+			uint32_t m_line;
+		};
+
+		typedef std::unordered_map<std::string, uint32_t> NameMap_t;
+
+		uint32_t lookupName(const std::string &file);
+
+		bool validate(const uint8_t *data, size_t size);
+
+		void unmap();
+
+		std::string m_path;
+		std::string m_directory;
+		std::string m_key;
+
+		// The entry, mapped or stored
+		const uint8_t *m_data;
+		size_t m_size;
+		bool m_mapped;
+
+		// Recorded
+		std::vector<Function> m_functions;
+		std::vector<Cu> m_cus;
+		std::vector<uint32_t> m_cuFiles; // Name indices
+		std::vector<Line> m_lines;
+		std::vector<std::string> m_names;
+		NameMap_t m_nameMap;
+	};
+}
@@ -1,19 +1,116 @@
 #include "dwarf.hh"
 
 #include <utils.hh>
+#include <filter.hh>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
 
+#include <atomic>
 
 using namespace kcov;
 
+// Below that, the threads aren't worth it
+#define PARALLEL_MIN_CUS 64
+#define CUS_PER_CHUNK 16
+
+namespace kcov
+{
+/*
+ * The lines of a range of CUs, parsed by a worker and passed on to the
+ * listener in CU order on the calling thread.
+ */
+class LineChunk : public IFileParser::ILineListener
+{
+public:
+	LineChunk(size_t first, size_t last) :
+		m_first(first), m_last(last)
+	{
+	}
+
+	virtual ~LineChunk()
+	{
+	}
+
+	void onLine(const std::string &file, unsigned int lineNr, uint64_t addr)
+	{
+		// The lines of a CU are mostly from the same file
+		if (m_names.empty() || m_names.back() != file)
+			m_names.push_back(file);
+
+		Line cur;
+
+		cur.m_name = m_names.size() - 1;
+		cur.m_line = lineNr;
+		cur.m_addr = addr;
+		m_lines.push_back(cur);
+	}
+
+	void replay(IFileParser::ILineListener &listener)
+	{
+		for (std::vector<Line>::const_iterator it = m_lines.begin();
+				it != m_lines.end();
+				++it)
+			listener.onLine(m_names[it->m_name], it->m_line, it->m_addr);
+	}
+
+	const size_t m_first;
+	const size_t m_last; // Exclusive
+	Semaphore m_done;
+
+private:
+	struct Line
+	{
+		uint32_t m_name;
+		uint32_t m_line;
+		uint64_t m_addr;
+	};
+
+	std::vector<std::string> m_names;
+	std::vector<Line> m_lines;
+};
+
+class ParallelLines
+{
+public:
+	ParallelLines(const std::vector<Dwarf_Off> &cus, IFilter *filter) :
+		m_cus(cus), m_filter(filter), m_nextChunk(0)
+	{
+	}
+
+	const std::vector<Dwarf_Off> &m_cus;
+	IFilter *m_filter;
+	std::vector<LineChunk *> m_chunks;
+	std::atomic<size_t> m_nextChunk;
+	Semaphore m_slots; // Limits the chunks which haven't been passed on yet
+};
+
+class LineWorker
+{
+public:
+	LineWorker(DwarfParser &parser, ParallelLines &work) :
+		m_parser(parser), m_work(work)
+	{
+	}
+
+	DwarfParser &m_parser;
+	ParallelLines &m_work;
+};
+}
+
 DwarfParser::DwarfParser() :
 		m_fd(-1),
-		m_dwarf(NULL)
+		m_dwarf(NULL),
+		m_threads(1)
+{
+}
+
+void DwarfParser::setThreads(unsigned int threads)
 {
+	m_threads = threads > 0 ? threads : 1;
 }
 
 DwarfParser::~DwarfParser()
@@ -21,81 +118,373 @@ DwarfParser::~DwarfParser()
 	close();
 }
 
-void DwarfParser::forEachLine(IFileParser::ILineListener& listener)
+void DwarfParser::forEachLine(IFileParser::ILineListener& listener, IFilter *filter)
 {
 	if (!m_dwarf)
 		return;
 
+	std::vector<Dwarf_Off> cus = getCuOffsets();
+
+	if (m_threads > 1 && cus.size() >= PARALLEL_MIN_CUS) {
+		forEachLineParallel(cus, listener, filter);
+		return;
+	}
+
+	FilterCache_t filterCache;
+
+	for (std::vector<Dwarf_Off>::const_iterator it = cus.begin();
+			it != cus.end();
+			++it)
+		forEachLineInCu(*it, listener, filter, filterCache);
+}
+
+// The offsets of the CU DIEs
+std::vector<Dwarf_Off> DwarfParser::getCuOffsets()
+{
+	std::vector<Dwarf_Off> out;
 	Dwarf_Off offset = 0;
 	Dwarf_Off lastOffset = 0;
 	size_t headerSize;
 
 	/* Iterate over the headers */
 	while (dwarf_nextcu(m_dwarf, offset, &offset, &headerSize, 0, 0, 0) == 0) {
-		Dwarf_Lines* lines;
-		Dwarf_Files *files;
-		size_t lineCount;
-		size_t fileCount;
-		Dwarf_Die die;
-		unsigned int i;
+		out.push_back(lastOffset + headerSize);
+		lastOffset = offset;
+	}
 
-		if (dwarf_offdie(m_dwarf, lastOffset + headerSize, &die) == NULL)
+	return out;
+}
+
+void DwarfParser::forEachLineInCu(Dwarf_Off dieOffset, IFileParser::ILineListener &listener,
+		IFilter *filter, FilterCache_t &filterCache)
+{
+	Dwarf_Lines* lines;
+	Dwarf_Files *files;
+	size_t lineCount;
+	size_t fileCount;
+	Dwarf_Die die;
+	unsigned int i;
+
+	if (dwarf_offdie(m_dwarf, dieOffset, &die) == NULL)
+		return;
+
+	/* The files first, the lines aren't needed if all are filtered out */
+	if (dwarf_getsrcfiles(&die, &files, &fileCount) != 0)
+		return;
+
+	const char *const *srcDirs;
+	size_t ndirs = 0;
+
+	/* Lookup the compilation path */
+	if (dwarf_getsrcdirs(files, &srcDirs, &ndirs) != 0)
+		return;
+
+	if (ndirs == 0)
+		return;
+
+	SourceFileMap_t sourceFiles;
+
+	if (!setupSourceFiles(files, fileCount, srcDirs, filter, filterCache, sourceFiles))
+		return;
+
+	/* Get the source lines */
+	if (dwarf_getsrclines(&die, &lines, &lineCount) != 0)
+		return;
+
+	/* Iterate through the source lines */
+	for (i = 0; i < lineCount; i++) {
+		Dwarf_Line *line;
+		int lineNr = 0;
+		const char* lineSource;
+		Dwarf_Word mtime, len;
+		bool isCode;
+		Dwarf_Addr addr;
+
+		if ( !(line = dwarf_onesrcline(lines, i)) )
 			continue;
 
-		lastOffset = offset;
+		if (dwarf_lineno(line, &lineNr) != 0)
+			continue;
 
-		/* Get the source lines */
-		if (dwarf_getsrclines(&die, &lines, &lineCount) != 0)
+		if (!(lineSource = dwarf_linesrc(line, &mtime, &len)) )
 			continue;
 
-		/* And the files */
-		if (dwarf_getsrcfiles(&die, &files, &fileCount) != 0)
+		if (dwarf_linebeginstatement(line, &isCode) != 0)
 			continue;
 
-		const char *const *srcDirs;
-		size_t ndirs = 0;
+		if (dwarf_lineaddr(line, &addr) != 0)
+			continue;
 
-		/* Lookup the compilation path */
-		if (dwarf_getsrcdirs(files, &srcDirs, &ndirs) != 0)
+		// Invalid line number?
+		if (lineNr == 0)
 			continue;
 
-		if (ndirs == 0)
+		// Non-code?
+		if (!isCode)
 			continue;
 
-		/* Iterate through the source lines */
-		for (i = 0; i < lineCount; i++) {
-			Dwarf_Line *line;
-			int lineNr = 0;
-			const char* lineSource;
-			Dwarf_Word mtime, len;
-			bool isCode;
-			Dwarf_Addr addr;
+		// The names are from the file table, so normally already known
+		SourceFileMap_t::const_iterator it = sourceFiles.find(lineSource);
 
-			if ( !(line = dwarf_onesrcline(lines, i)) )
-				continue;
+		if (it == sourceFiles.end())
+			it = sourceFiles.insert(std::make_pair(lineSource,
+					lookupSourceFile(srcDirs, lineSource, filter, filterCache))).first;
 
-			if (dwarf_lineno(line, &lineNr) != 0)
-				continue;
+		if (!it->second.m_included)
+			continue;
 
-			if (!(lineSource = dwarf_linesrc(line, &mtime, &len)) )
-				continue;
+		listener.onLine(it->second.m_path, lineNr, addr);
+	}
+}
 
-			if (dwarf_linebeginstatement(line, &isCode) != 0)
-				continue;
+/*
+ * The CUs are parsed in chunks by a pool of workers, each with its own libdw
+ * handle, since they can't be shared between threads. The chunks are then
+ * passed on in order, so the listener sees exactly what it would with a
+ * single thread. The workers stay within a window of chunks from the one
+ * which is passed on, to keep the memory bounded.
+ */
+void DwarfParser::forEachLineParallel(const std::vector<Dwarf_Off> &cus,
+		IFileParser::ILineListener &listener, IFilter *filter)
+{
+	ParallelLines work(cus, filter);
+	std::vector<LineWorker *> workers;
+	std::vector<pthread_t> threads;
 
-			if (dwarf_lineaddr(line, &addr) != 0)
-				continue;
+	for (size_t i = 0; i < cus.size(); i += CUS_PER_CHUNK)
+		work.m_chunks.push_back(new LineChunk(i, std::min(i + CUS_PER_CHUNK, cus.size())));
 
-			// Invalid line number?
-			if (lineNr == 0)
-				continue;
+	for (unsigned int i = 0; i < m_threads * 4; i++)
+		work.m_slots.notify();
+
+	for (unsigned int i = 0; i < m_threads; i++) {
+		DwarfParser *parser = new DwarfParser();
+		pthread_t thread;
+
+		if (!parser->open(m_filename)) {
+			delete parser;
+			break;
+		}
+
+		LineWorker *worker = new LineWorker(*parser, work);
 
-			// Non-code?
-			if (!isCode)
+		if (pthread_create(&thread, NULL, DwarfParser::lineThreadStatic, (void *)worker) != 0) {
+			delete worker;
+			delete parser;
+			break;
+		}
+		workers.push_back(worker);
+		threads.push_back(thread);
+	}
+
+	kcov_debug(ELF_MSG, "Parsing %zu CUs in %s with %zu threads\n",
+			cus.size(), m_filename.c_str(), threads.size());
+
+	// Nothing started, do it here instead
+	if (threads.empty()) {
+		FilterCache_t filterCache;
+
+		for (size_t i = 0; i < cus.size(); i++)
+			forEachLineInCu(cus[i], listener, filter, filterCache);
+	}
+
+	for (std::vector<LineChunk *>::iterator it = work.m_chunks.begin();
+			!threads.empty() && it != work.m_chunks.end();
+			++it) {
+		LineChunk *chunk = *it;
+
+		chunk->m_done.wait();
+		chunk->replay(listener);
+		work.m_slots.notify();
+	}
+
+	for (size_t i = 0; i < threads.size(); i++) {
+		void *rv;
+
+		// Let the ones waiting for a slot see that everything is done
+		work.m_slots.notify();
+		pthread_join(threads[i], &rv);
+	}
+
+	for (std::vector<LineWorker *>::iterator it = workers.begin();
+			it != workers.end();
+			++it) {
+		delete &(*it)->m_parser;
+		delete *it;
+	}
+
+	for (std::vector<LineChunk *>::iterator it = work.m_chunks.begin();
+			it != work.m_chunks.end();
+			++it)
+		delete *it;
+}
+
+void DwarfParser::lineThread(ParallelLines &work)
+{
+	FilterCache_t filterCache;
+
+	while (1) {
+		work.m_slots.wait();
+
+		size_t i = work.m_nextChunk++;
+
+		if (i >= work.m_chunks.size())
+			break;
+
+		LineChunk *chunk = work.m_chunks[i];
+
+		for (size_t cu = chunk->m_first; cu < chunk->m_last; cu++)
+			forEachLineInCu(work.m_cus[cu], *chunk, work.m_filter, filterCache);
+
+		chunk->m_done.notify();
+	}
+}
+
+void *DwarfParser::lineThreadStatic(void *pWorker)
+{
+	LineWorker *worker = (LineWorker *)pWorker;
+
+	worker->m_parser.lineThread(worker->m_work);
+
+	return NULL;
+}
+
+/*
+ * Setup the full paths of the files of a CU, and run the filter on them.
+ * Returns false if all of them are filtered out.
+ */
+bool DwarfParser::setupSourceFiles(Dwarf_Files *files, size_t fileCount,
+		const char *const *srcDirs, IFilter *filter,
+		FilterCache_t &filterCache, SourceFileMap_t &out)
+{
+	bool anyIncluded = false;
+
+	for (size_t i = 0; i < fileCount; i++) {
+		const char *name = dwarf_filesrc(files, i, NULL, NULL);
+
+		if (!name || out.find(name) != out.end())
+			continue;
+
+		SourceFile cur = lookupSourceFile(srcDirs, name, filter, filterCache);
+
+		anyIncluded |= cur.m_included;
+		out.insert(std::make_pair(name, cur));
+	}
+
+	return anyIncluded;
+}
+
+// Filtered once per path, many CUs include the same headers
+DwarfParser::SourceFile DwarfParser::lookupSourceFile(const char *const *srcDirs,
+		const char *name, IFilter *filter, FilterCache_t &filterCache)
+{
+	SourceFile out;
+
+	out.m_path = fullPath(srcDirs, name);
+	out.m_included = true;
+
+	if (!filter)
+		return out;
+
+	FilterCache_t::const_iterator it = filterCache.find(out.m_path);
+
+	if (it != filterCache.end()) {
+		out.m_included = it->second;
+	} else {
+		out.m_included = filter->runFilters(filter->mangleSourcePath(out.m_path));
+		filterCache[out.m_path] = out.m_included;
+	}
+
+	return out;
+}
+
+int DwarfParser::onFuncStatic(Dwarf_Die *die, void *arg)
+{
+	IFileParser::IFunctionListener *listener = (IFileParser::IFunctionListener *)arg;
+	Dwarf_Addr low, high;
+
+	if (dwarf_lowpc(die, &low) == 0 && dwarf_highpc(die, &high) == 0 && high > low) {
+		listener->onFunction(low, high);
+		return DWARF_CB_OK;
+	}
+
+	/*
+	 * Split in multiple ranges (DW_AT_ranges), e.g., with a cold part. Report
+	 * the range with the entry point, or the first one if there's no entry pc.
+	 * Lines in the other ranges are then not part of any function.
+	 */
+	Dwarf_Addr entry, base, start, end;
+	bool hasEntry = dwarf_entrypc(die, &entry) == 0;
+	ptrdiff_t offset = 0;
+
+	while ((offset = dwarf_ranges(die, offset, &base, &start, &end)) > 0) {
+		if (end <= start)
+			continue;
+
+		if (!hasEntry) {
+			listener->onFunction(start, end);
+			break;
+		}
+
+		if (entry >= start && entry < end) {
+			listener->onFunction(entry, end);
+			break;
+		}
+	}
+
+	return DWARF_CB_OK;
+}
+
+void DwarfParser::forEachFunction(IFileParser::IFunctionListener &listener, IFilter *filter,
+		ICuListener *cuListener)
+{
+	if (!m_dwarf)
+		return;
+
+	Dwarf_Off offset = 0;
+	Dwarf_Off lastOffset = 0;
+	size_t headerSize;
+	FilterCache_t filterCache;
+
+	/* Iterate over the headers */
+	while (dwarf_nextcu(m_dwarf, offset, &offset, &headerSize, 0, 0, 0) == 0) {
+		Dwarf_Die die;
+
+		if (dwarf_offdie(m_dwarf, lastOffset + headerSize, &die) == NULL) {
+			lastOffset = offset;
+			continue;
+		}
+
+		lastOffset = offset;
+
+		// The lines of CUs with only filtered out files are skipped, so the functions as well
+		if (filter || cuListener) {
+			Dwarf_Files *files;
+			size_t fileCount;
+			const char *const *srcDirs;
+			size_t ndirs = 0;
+			SourceFileMap_t sourceFiles;
+			bool known = dwarf_getsrcfiles(&die, &files, &fileCount) == 0 &&
+					dwarf_getsrcdirs(files, &srcDirs, &ndirs) == 0 && ndirs > 0;
+
+			if (known &&
+					!setupSourceFiles(files, fileCount, srcDirs, filter, filterCache, sourceFiles) &&
+					filter)
 				continue;
 
-			listener.onLine(fullPath(srcDirs, lineSource), lineNr, addr);
+			if (cuListener) {
+				std::vector<std::string> paths;
+
+				for (SourceFileMap_t::const_iterator it = sourceFiles.begin();
+						it != sourceFiles.end();
+						++it)
+					paths.push_back(it->second.m_path);
+
+				cuListener->onCu(known ? &paths : NULL);
+			}
 		}
+
+		dwarf_getfuncs(&die, onFuncStatic, (void *)&listener, 0);
 	}
 }
 
@@ -178,6 +567,7 @@ bool DwarfParser::open(const std::string& filename)
 {
 	close();
 
+	m_filename = filename;
 	m_fd = ::open(filename.c_str(), O_RDONLY);
 
 	if (m_fd < 0)
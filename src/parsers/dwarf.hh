@@ -2,31 +2,108 @@
 
 #include <string>
 #include <vector>
+#include <unordered_map>
 
 #include <elfutils/libdw.h>
 #include <file-parser.hh>
 
 namespace kcov
 {
+	class IFilter;
+	class ParallelLines;
+
 	class DwarfParser
 	{
 	public:
+		class ICuListener
+		{
+		public:
+			virtual ~ICuListener() {}
+
+			/**
+			 * Called before the functions of each CU.
+			 *
+			 * @param files the full paths of the files of the CU, or NULL
+			 * if they are unknown (and the CU then can't be filtered out)
+			 */
+			virtual void onCu(const std::vector<std::string> *files) = 0;
+		};
+
 		DwarfParser();
 
 		~DwarfParser();
 
 		bool open(const std::string &filename);
 
-		void forEachLine(IFileParser::ILineListener &listener);
+		/**
+		 * Set the number of threads for forEachLine, which then parses the
+		 * CUs of large binaries in parallel. The lines are reported in the
+		 * same order anyway.
+		 *
+		 * @param threads the number of threads, 1 (the default) to not use any
+		 */
+		void setThreads(unsigned int threads);
+
+		/**
+		 * Report the source lines
+		 *
+		 * @param listener the listener
+		 * @param filter if set, skip the files it filters out, and the
+		 * CUs where all files are
+		 */
+		void forEachLine(IFileParser::ILineListener &listener, IFilter *filter = NULL);
+
+		/**
+		 * Report the functions
+		 *
+		 * @param listener the listener
+		 * @param filter if set, skip the CUs where all files are filtered out
+		 * @param cuListener if set, told about the CU of the functions which follow
+		 */
+		void forEachFunction(IFileParser::IFunctionListener &listener, IFilter *filter = NULL,
+				ICuListener *cuListener = NULL);
 
 		void forAddress(IFileParser::ILineListener &listener, uint64_t address);
 
 	private:
+		class SourceFile
+		{
+		public:
+			std::string m_path;
+			bool m_included;
+		};
+
+		typedef std::unordered_map<const char *, SourceFile> SourceFileMap_t; // File table name -> file
+		typedef std::unordered_map<std::string, bool> FilterCache_t;
+
+		bool setupSourceFiles(Dwarf_Files *files, size_t fileCount,
+				const char *const *srcDirs, IFilter *filter,
+				FilterCache_t &filterCache, SourceFileMap_t &out);
+
+		SourceFile lookupSourceFile(const char *const *srcDirs, const char *name,
+				IFilter *filter, FilterCache_t &filterCache);
+
+		std::vector<Dwarf_Off> getCuOffsets();
+
+		void forEachLineInCu(Dwarf_Off dieOffset, IFileParser::ILineListener &listener,
+				IFilter *filter, FilterCache_t &filterCache);
+
+		void forEachLineParallel(const std::vector<Dwarf_Off> &cus,
+				IFileParser::ILineListener &listener, IFilter *filter);
+
+		void lineThread(ParallelLines &work);
+
+		static void *lineThreadStatic(void *pWorker);
+
 		std::string fullPath(const char *const *srcDirs, const std::string &filename);
 
 		void close();
 
+		static int onFuncStatic(Dwarf_Die *die, void *arg);
+
 		int m_fd;
 		Dwarf *m_dwarf;
+		std::string m_filename;
+		unsigned int m_threads;
 	};
 }
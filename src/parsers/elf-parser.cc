@@ -4,15 +4,22 @@
 #include <capabilities.hh>
 #include <gcov.hh>
 #include <phdr_data.h>
+#include <shadow-text.hh>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
 #include <libelf.h>
 #include <dwarf.h>
 #include <elfutils/libdw.h>
+#include <atomic>
 #include <map>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include <string>
 #include <configuration.hh>
@@ -27,6 +34,7 @@
 
 #include "address-verifier.hh"
 #include "dwarf.hh"
+#include "dwarf-cache.hh"
 
 using namespace kcov;
 
@@ -118,10 +126,135 @@ private:
 };
 typedef std::vector<Segment> SegmentList_t;
 
-class ElfInstance : public IFileParser, IFileParser::ILineListener
+// The disassembler isn't necessarily thread safe
+static std::mutex g_verifyMutex;
+
+/**
+ * The events of one solib, recorded by a parser worker and replayed to
+ * the listeners on the tracer thread.
+ */
+class ParseRecorder : public IFileParser::IFileListener,
+	public IFileParser::ILineListener, public IFileParser::IFunctionListener
+{
+public:
+	enum EventType
+	{
+		EV_FILE,
+		EV_FUNCTION,
+		EV_LINE,
+	};
+
+	struct Event
+	{
+		enum EventType m_type;
+		uint32_t m_file;   // Index into the file names
+		uint32_t m_value;  // Line number or file flags
+		uint64_t m_addr;
+		uint64_t m_end;
+	};
+
+	typedef std::vector<Event> EventList_t;
+	typedef std::vector<std::string> NameList_t;
+
+	const EventList_t &getEvents() const
+	{
+		return m_events;
+	}
+
+	const NameList_t &getNames() const
+	{
+		return m_names;
+	}
+
+	// From IFileParser::IFileListener
+	void onFile(const IFileParser::File &file)
+	{
+		addEvent(EV_FILE, lookupName(file.m_filename), file.m_flags, 0, 0);
+	}
+
+	// From IFileParser::ILineListener, with the unmangled source path
+	void onLine(const std::string &file, unsigned int lineNr, uint64_t addr)
+	{
+		addEvent(EV_LINE, lookupName(file), lineNr, addr, 0);
+	}
+
+	// From IFileParser::IFunctionListener
+	void onFunction(uint64_t start, uint64_t end)
+	{
+		addEvent(EV_FUNCTION, 0, 0, start, end);
+	}
+
+private:
+	typedef std::unordered_map<std::string, uint32_t> NameMap_t;
+
+	void addEvent(enum EventType type, uint32_t file, uint32_t value, uint64_t addr, uint64_t end)
+	{
+		Event ev;
+
+		ev.m_type = type;
+		ev.m_file = file;
+		ev.m_value = value;
+		ev.m_addr = addr;
+		ev.m_end = end;
+
+		m_events.push_back(ev);
+	}
+
+	// Lines mostly come from a few files, so only store them once
+	uint32_t lookupName(const std::string &name)
+	{
+		NameMap_t::const_iterator it = m_nameMap.find(name);
+
+		if (it != m_nameMap.end())
+			return it->second;
+
+		uint32_t out = m_names.size();
+
+		m_names.push_back(name);
+		m_nameMap[name] = out;
+
+		return out;
+	}
+
+	EventList_t m_events;
+	NameList_t m_names;
+	NameMap_t m_nameMap;
+};
+
+class ElfInstance : public IFileParser, IFileParser::ILineListener, IFileParser::IFunctionListener
 {
 public:
 	ElfInstance()
+	{
+		setupDefaults();
+
+		IParserManager::getInstance().registerParser(*this);
+	}
+
+	/*
+	 * A worker for parsing a solib on another thread, setup like the
+	 * parent. The events are recorded instead, to be replayed by it.
+	 */
+	ElfInstance(const ElfInstance &parent, ParseRecorder &recorder)
+	{
+		setupDefaults();
+
+		m_isMainFile = false;
+		m_initialized = true;
+		m_elfIs32Bit = parent.m_elfIs32Bit;
+		m_verifyAddresses = parent.m_verifyAddresses;
+		m_functionsOnly = parent.m_functionsOnly;
+		m_cacheDirectory = parent.m_cacheDirectory;
+		m_filter = parent.m_filter;
+		m_recorder = &recorder;
+
+		m_fileListeners.push_back(&recorder);
+		m_lineListeners.push_back(&recorder);
+		if (!parent.m_functionListeners.empty())
+			m_functionListeners.push_back(&recorder);
+	}
+
+	void setupDefaults()
 	{
 		m_elf = NULL;
 		m_addressVerifier = IAddressVerifier::create();
@@ -133,11 +266,13 @@ public:
 		m_initialized = false;
 		m_filter = NULL;
 		m_verifyAddresses = false;
+		m_functionsOnly = false;
 		m_debuglinkCrc = 0;
 		m_relocation = 0;
 		m_invalidBreakpoints = 0;
-
-		IParserManager::getInstance().registerParser(*this);
+		m_hasTextRelocations = false;
+		m_recorder = NULL;
+		m_dwarfThreads = 1;
 	}
 
 	virtual ~ElfInstance()
@@ -184,6 +319,9 @@ public:
 	{
 		if (!m_initialized) {
 			m_verifyAddresses = IConfiguration::getInstance().keyAsInt("verify");
+			m_functionsOnly = IConfiguration::getInstance().keyAsInt("functions-only");
+			m_cacheDirectory = IConfiguration::getInstance().keyAsString("line-cache");
+			m_dwarfThreads = getParseThreads();
 
 			panic_if(elf_version(EV_CURRENT) == EV_NONE,
 					"ELF version failed\n");
@@ -195,6 +333,7 @@ public:
 
 		m_buildId.clear();
 		m_debuglink.clear();
+		m_cacheKey.clear();
 
 		m_curSegments.clear();
 		m_executableSegments.clear();
@@ -289,6 +428,67 @@ out_open:
 		return out;
 	}
 
+	/*
+	 * New solibs, often very many at startup: They are parsed by a pool of
+	 * workers, each into its own event list. The lists are then replayed
+	 * in order, so the listeners see the same thing as for a serial parse.
+	 * Each is replayed as soon as it and the ones before are done.
+	 */
+	void parseSolibs(const IFileParser::SolibList_t &solibs)
+	{
+		unsigned int nThreads = m_dwarfThreads;
+
+		if (nThreads > solibs.size())
+			nThreads = solibs.size();
+
+		if (nThreads <= 1) {
+			IFileParser::parseSolibs(solibs);
+			return;
+		}
+
+		// The rest of the threads for the CUs of each solib
+		ParseBatch batch(*this, m_dwarfThreads / nThreads);
+
+		for (IFileParser::SolibList_t::const_iterator it = solibs.begin();
+				it != solibs.end();
+				++it)
+			batch.m_jobs.push_back(new ParseJob(*it));
+
+		std::vector<pthread_t> threads;
+
+		for (unsigned int i = 0; i < nThreads; i++) {
+			pthread_t thread;
+
+			if (pthread_create(&thread, NULL, ElfInstance::parseThreadStatic, (void *)&batch) == 0)
+				threads.push_back(thread);
+		}
+
+		// Do it here instead
+		if (threads.empty())
+			parseThread(batch);
+
+		kcov_debug(ELF_MSG, "Parsing %zu solibs with %zu threads\n",
+				solibs.size(), threads.size());
+
+		for (std::vector<ParseJob *>::iterator it = batch.m_jobs.begin();
+				it != batch.m_jobs.end();
+				++it) {
+			ParseJob *job = *it;
+
+			job->m_done.wait();
+			replay(job->m_recorder);
+			delete job;
+		}
+
+		for (std::vector<pthread_t>::iterator it = threads.begin();
+				it != threads.end();
+				++it) {
+			void *rv;
+
+			pthread_join(*it, &rv);
+		}
+	}
+
 	bool doParse(unsigned long relocation)
 	{
 		struct stat st;
@@ -299,14 +499,37 @@ out_open:
 		parseOneElf();
 
 		// Gcov data?
-		if (IConfiguration::getInstance().keyAsInt("gcov") && !m_gcnoFiles.empty())
+		if (IConfiguration::getInstance().keyAsInt("gcov") && !m_gcnoFiles.empty()) {
 			parseGcnoFiles(relocation);
-		else
+		} else {
+			setupShadowText(relocation);
 			parseOneDwarf(relocation);
+		}
 
 		return true;
 	}
 
+	/*
+	 * Make the on-disk text available to the engine, so that the original
+	 * instructions don't need to be read from the process.
+	 */
+	void setupShadowText(unsigned long relocation)
+	{
+		IShadowText &shadow = IShadowText::getInstance();
+
+		for (SegmentList_t::const_iterator it = m_executableSegments.begin();
+				it != m_executableSegments.end();
+				++it) {
+			if (!it->getData())
+				continue;
+
+			uint64_t addr = adjustAddressBySegment(it->getBase()) + relocation;
+
+			shadow.addRegion(m_filename, addr - it->getBase(), addr,
+					it->getData(), it->getSize(), !m_hasTextRelocations);
+		}
+	}
+
 	bool setMainFileRelocation(unsigned long relocation)
 	{
 		kcov_debug(INFO_MSG, "main file relocation = %#lx\n", relocation);
@@ -380,8 +603,25 @@ out_open:
 		m_invalidBreakpoints = 0;
 		m_relocation = relocation;
 
+		bool useCache = m_cacheDirectory != "" && m_cacheKey != "";
+		DwarfCache cache(m_cacheDirectory, m_cacheKey);
+		IFileParser::IFunctionListener *functionListener = NULL;
+
+		if (!m_functionListeners.empty() || m_functionsOnly)
+			functionListener = this;
+
+		// Seen before, no need for libdw
+		if (useCache && cache.load()) {
+			m_functionEntries.clear();
+			cache.replay(*this, functionListener, m_filter);
+
+			return true;
+		}
+
 		DwarfParser dp;
 
+		dp.setThreads(m_dwarfThreads);
+
 		bool rv = dp.open(m_filename);
 
 		if (!rv && m_buildId.length() > 0) {
@@ -416,8 +656,23 @@ out_open:
 			return false;
 		}
 
-		/* Iterate over the headers */
-		dp.forEachLine(*this);
+		// Before the lines, so that listeners can group them by function
+		m_functionEntries.clear();
+		if (useCache) {
+			// Always with the functions, which later runs might need, and their CUs to filter them
+			dp.forEachFunction(cache, NULL, &cache);
+			dp.forEachLine(cache);
+
+			if (!cache.store())
+				kcov_debug(ELF_MSG, "Can't store the DWARF cache entry for %s\n", m_filename.c_str());
+			cache.replay(*this, functionListener, m_filter);
+		} else {
+			if (functionListener)
+				dp.forEachFunction(*this, m_filter);
+
+			/* Iterate over the headers, the filtered out files are skipped */
+			dp.forEachLine(*this, m_filter);
+		}
 
 		if (m_invalidBreakpoints > 0) {
 			kcov_debug(STATUS_MSG, "kcov: %u invalid breakpoints skipped in %s\n",
@@ -459,6 +714,7 @@ out_open:
 		}
 
 		setupSegments = m_curSegments.size() == 0;
+		m_hasTextRelocations = false;
 		while ( (scn = elf_nextscn(m_elf, scn)) != NULL )
 		{
 			uint64_t sh_type;
@@ -564,6 +820,10 @@ out_open:
 				}
 			}
 
+			// Text relocations mean the loaded text differs from the file
+			if (sh_type == SHT_DYNAMIC && data->d_buf)
+				m_hasTextRelocations = hasTextRelocations(data);
+
 			// Check for debug links
 			if (strcmp(name, ".gnu_debuglink") == 0) {
 				const char *p = (const char *)data->d_buf;
@@ -590,6 +850,14 @@ out_open:
 			m_executableSegments.push_back(seg);
 		}
 
+		// The build-id identifies the debug information, otherwise the contents
+		if (m_cacheDirectory != "") {
+			if (m_buildId != "")
+				m_cacheKey = m_buildId;
+			else
+				m_cacheKey = fmt("%08x-%zx", hash_block(fileData, fileSize), fileSize);
+		}
+
 		// If we have gcda files, try to find the corresponding gcno dittos
 		for (FileList_t::iterator it = gcdaFiles.begin();
 				it != gcdaFiles.end();
@@ -619,13 +887,131 @@ out_elf_begin:
 		m_lineListeners.push_back(&listener);
 	}
 
+	void registerFunctionListener(IFileParser::IFunctionListener &listener)
+	{
+		m_functionListeners.push_back(&listener);
+	}
+
 	void registerFileListener(IFileParser::IFileListener &listener)
 	{
 		m_fileListeners.push_back(&listener);
 	}
 
 private:
+	class ParseJob
+	{
+	public:
+		ParseJob(struct phdr_data_entry *entry) :
+			m_entry(entry)
+		{
+		}
+
+		struct phdr_data_entry *m_entry;
+		ParseRecorder m_recorder;
+		Semaphore m_done;
+	};
+
+	class ParseBatch
+	{
+	public:
+		ParseBatch(ElfInstance &parent, unsigned int dwarfThreads) :
+			m_parent(parent), m_dwarfThreads(dwarfThreads), m_nextJob(0)
+		{
+		}
+
+		ElfInstance &m_parent;
+		unsigned int m_dwarfThreads;
+		std::vector<ParseJob *> m_jobs;
+		std::atomic<size_t> m_nextJob;
+	};
+
+	// Configured, or the CPUs we may run on (one with --pin-cpu)
+	static unsigned int getParseThreads()
+	{
+		int configured = IConfiguration::getInstance().keyAsInt("parse-threads");
+		cpu_set_t set;
+
+		if (configured > 0)
+			return configured;
+
+		if (sched_getaffinity(0, sizeof(set), &set) < 0)
+			return 1;
+
+		return CPU_COUNT(&set);
+	}
+
+	void parseThread(ParseBatch &batch)
+	{
+		while (1) {
+			size_t i = batch.m_nextJob++;
+
+			if (i >= batch.m_jobs.size())
+				break;
+
+			ParseJob *job = batch.m_jobs[i];
+			ElfInstance worker(*this, job->m_recorder);
+
+			worker.m_dwarfThreads = batch.m_dwarfThreads;
+			worker.addFile(job->m_entry->name, job->m_entry);
+			worker.parse();
+
+			job->m_done.notify();
+		}
+	}
+
+	static void *parseThreadStatic(void *pBatch)
+	{
+		ParseBatch *batch = (ParseBatch *)pBatch;
+
+		batch->m_parent.parseThread(*batch);
+
+		return NULL;
+	}
+
+	// Pass on the recorded events of a worker
+	void replay(const ParseRecorder &recorder)
+	{
+		const ParseRecorder::NameList_t &names = recorder.getNames();
+		const ParseRecorder::EventList_t &events = recorder.getEvents();
+		std::vector<std::string> mangled(names.size());
+		std::vector<bool> isMangled(names.size(), false);
+
+		for (ParseRecorder::EventList_t::const_iterator it = events.begin();
+				it != events.end();
+				++it) {
+			const ParseRecorder::Event &ev = *it;
+
+			switch (ev.m_type)
+			{
+			case ParseRecorder::EV_FILE:
+				for (FileListenerList_t::const_iterator lit = m_fileListeners.begin();
+						lit != m_fileListeners.end();
+						++lit)
+					(*lit)->onFile(File(names[ev.m_file], (enum IFileParser::FileFlags)ev.m_value));
+				break;
+			case ParseRecorder::EV_FUNCTION:
+				for (FunctionListenerList_t::const_iterator lit = m_functionListeners.begin();
+						lit != m_functionListeners.end();
+						++lit)
+					(*lit)->onFunction(ev.m_addr, ev.m_end);
+				break;
+			case ParseRecorder::EV_LINE:
+				if (!isMangled[ev.m_file]) {
+					mangled[ev.m_file] = m_filter->mangleSourcePath(names[ev.m_file]);
+					isMangled[ev.m_file] = true;
+				}
+
+				for (LineListenerList_t::const_iterator lit = m_lineListeners.begin();
+						lit != m_lineListeners.end();
+						++lit)
+					(*lit)->onLine(mangled[ev.m_file], ev.m_value, ev.m_addr);
+				break;
+			}
+		}
+	}
+
 	typedef std::vector<IFileParser::ILineListener *> LineListenerList_t;
+	typedef std::vector<IFileParser::IFunctionListener *> FunctionListenerList_t;
 	typedef std::vector<IFileListener *> FileListenerList_t;
 	typedef std::vector<std::string> FileList_t;
 
@@ -638,6 +1024,7 @@ private:
 				bool out = true;
 
 				if (m_verifyAddresses) {
+					std::lock_guard<std::mutex> lock(g_verifyMutex);
 					uint64_t offset = addr - it->getBase();
 
 					out = m_addressVerifier->verify(it->getData(),it->getSize(), offset);
@@ -656,6 +1043,35 @@ private:
 		return false;
 	}
 
+	bool hasTextRelocations(Elf_Data *data) const
+	{
+		size_t entrySize = m_elfIs32Bit ? sizeof(Elf32_Dyn) : sizeof(Elf64_Dyn);
+
+		for (size_t i = 0; i < data->d_size / entrySize; i++) {
+			uint64_t tag;
+			uint64_t val;
+
+			if (m_elfIs32Bit) {
+				Elf32_Dyn *dyn = &((Elf32_Dyn *)data->d_buf)[i];
+
+				tag = dyn->d_tag;
+				val = dyn->d_un.d_val;
+			} else {
+				Elf64_Dyn *dyn = &((Elf64_Dyn *)data->d_buf)[i];
+
+				tag = dyn->d_tag;
+				val = dyn->d_un.d_val;
+			}
+
+			if (tag == DT_NULL)
+				break;
+			if (tag == DT_TEXTREL || (tag == DT_FLAGS && (val & DF_TEXTREL)))
+				return true;
+		}
+
+		return false;
+	}
+
 	uint64_t adjustAddressBySegment(uint64_t addr)
 	{
 		for (SegmentList_t::const_iterator it = m_curSegments.begin();
@@ -677,7 +1093,19 @@ private:
 		if (!addressIsValid(addr, m_invalidBreakpoints))
 			return;
 
-		std::string rp = m_filter->mangleSourcePath(file);
+		// Only the first line at each function entry
+		if (m_functionsOnly && m_functionEntries.erase(addr) == 0)
+			return;
+
+		/*
+		 * The lines mostly come in runs from the same file. Workers leave
+		 * it to the replay, which does it once per file.
+		 */
+		if (!m_recorder && file != m_lastSourcePath) {
+			m_lastSourcePath = file;
+			m_lastMangledPath = m_filter->mangleSourcePath(file);
+		}
+		const std::string &rp = m_recorder ? file : m_lastMangledPath;
 
 		for (LineListenerList_t::const_iterator it = m_lineListeners.begin();
 				it != m_lineListeners.end();
@@ -686,6 +1114,27 @@ private:
 	}
 
 
+	// From IFileParser::IFunctionListener
+	void onFunction(uint64_t start, uint64_t end)
+	{
+		unsigned int invalid = 0;
+
+		if (!addressIsValid(start, invalid))
+			return;
+
+		if (m_functionsOnly)
+			m_functionEntries.insert(start);
+
+		// The end can be outside of the segment
+		uint64_t adjusted = adjustAddressBySegment(start) + m_relocation;
+
+		for (FunctionListenerList_t::const_iterator it = m_functionListeners.begin();
+				it != m_functionListeners.end();
+				++it)
+			(*it)->onFunction(adjusted, adjusted + (end - start));
+	}
+
+
 	std::string tryDebugLink(const std::string &path)
 	{
 		if (!file_exists(path))
@@ -803,10 +1252,13 @@ private:
 
 	IAddressVerifier *m_addressVerifier;
 	bool m_verifyAddresses;
+	bool m_functionsOnly;
+	std::unordered_set<uint64_t> m_functionEntries; // Unrelocated
 	struct Elf *m_elf;
 	bool m_elfIs32Bit;
 	bool m_elfIsShared;
 	LineListenerList_t m_lineListeners;
+	FunctionListenerList_t m_functionListeners;
 	FileListenerList_t m_fileListeners;
 	std::string m_filename;
 	std::string m_buildId;
@@ -817,6 +1269,13 @@ private:
 	bool m_initialized;
 	uint64_t m_relocation;
 	uint32_t m_invalidBreakpoints;
+	bool m_hasTextRelocations;
+	ParseRecorder *m_recorder; // Set for workers
+	unsigned int m_dwarfThreads; // For solibs and CUs
+	std::string m_cacheDirectory; // Empty if not caching
+	std::string m_cacheKey;
+	std::string m_lastSourcePath;
+	std::string m_lastMangledPath;
 
 	/***** Add strings to update path information. *******/
 	std::string m_origRoot;
@@ -30,6 +30,7 @@ class Reporter :
 		public IFileParser::ILineListener,
 		public IFileParser::IFileListener,
 		public ICollector::IListener,
+		public ICollector::IBreakpointFilter,
 		public IReporter::IListener
 {
 public:
@@ -46,6 +47,10 @@ public:
 		m_hashFilename = fileParser.getParserType() == "ELF";
 
 		m_dbFileName = IConfiguration::getInstance().keyAsString("target-directory") + "/coverage.db";
+
+		// Addresses are identified by the line ID, which needs the filename hash
+		if (m_hashFilename && IConfiguration::getInstance().keyAsInt("skip-covered"))
+			m_collector.registerBreakpointFilter(*this);
 	}
 
 	~Reporter()
@@ -180,6 +185,8 @@ public:
 			if (!hits)
 				continue;
 
+			m_coveredIndexes[fileHash].push_back(addrIndex);
+
 			AddrToLineMap_t::iterator it = m_addrToLine.find(addr);
 
 			/*
@@ -327,22 +334,30 @@ private:
 		m_lineIdToFileMap[lineId] = line;
 
 		// Report pending addresses for this file/line
-		PendingFilesMap_t::const_iterator it = m_pendingFiles.find(lineId);
+		PendingFilesMap_t::iterator it = m_pendingFiles.find(lineId);
 		if (it != m_pendingFiles.end()) {
-			for (PendingHitsList_t::const_iterator fit = it->second.begin();
+			uint64_t addrIndex = line->getAddressIndex(addr);
+
+			for (PendingHitsList_t::iterator fit = it->second.begin();
 					fit != it->second.end();
-					++fit) {
+					) {
 				const PendingFileAddress &val = *fit;
 				unsigned long hits = val.m_hits;
 				uint64_t index = val.m_index;
 
+				// Later addresses of the line are handled when they are added
+				if (index != addrIndex) {
+					++fit;
+					continue;
+				}
+
 				reportAddress(lineId, hits);
 
 				line->registerHitIndex(index, hits, m_maxPossibleHits != IFileParser::HITS_UNLIMITED);
-			}
 
-			// Handled now
-			m_pendingFiles[lineId].clear();
+				// Handled now
+				fit = it->second.erase(fit);
+			}
 		}
 
 		for (ListenerList_t::const_iterator it = m_listeners.begin();
@@ -351,6 +366,30 @@ private:
 			(*it)->onLineReporter(file, lineNr, lineId);
 	}
 
+	// From ICollector::IBreakpointFilter, called before onLine() for the address
+	bool skipBreakpoint(const std::string &file, unsigned int lineNr, uint64_t addr)
+	{
+		uint64_t lineId = Line::getLineId(m_fileHash(file), lineNr);
+		CoveredIndexMap_t::const_iterator it = m_coveredIndexes.find(lineId);
+
+		if (it == m_coveredIndexes.end())
+			return false;
+
+		// The index this address has (or will get) in the line
+		FileMap_t::const_iterator fit = m_files.find(file);
+		const Line *line = fit != m_files.end() ? fit->second->getLine(lineNr) : NULL;
+		uint64_t addrIndex = line ? line->getAddressIndex(addr) : 0;
+
+		for (std::vector<uint64_t>::const_iterator cit = it->second.begin();
+				cit != it->second.end();
+				++cit) {
+			if (*cit == addrIndex)
+				return true;
+		}
+
+		return false;
+	}
+
 	// Called when a file is added (e.g., a shared library)
 	void onFile(const IFileParser::File &file)
 	{
@@ -416,7 +455,7 @@ private:
 		typedef std::vector<std::pair<uint64_t, int>> AddrToHitsMap_t;
 
 		Line(uint64_t fileHash, unsigned int lineNr) :
-			m_lineId((fileHash << 32ULL) | lineNr),
+			m_lineId(getLineId(fileHash, lineNr)),
 			m_order(0)
 		{
 		}
@@ -444,6 +483,21 @@ private:
 			m_addrs.push_back(std::pair<uint64_t, int>(addr, 0));
 		}
 
+		// The index of addr, or where it will be added
+		uint64_t getAddressIndex(uint64_t addr) const
+		{
+			uint64_t out = 0;
+
+			for (AddrToHitsMap_t::const_iterator it = m_addrs.begin();
+					it != m_addrs.end();
+					++it, out++) {
+				if (it->first == addr)
+					break;
+			}
+
+			return out;
+		}
+
 		void registerHit(uint64_t addr, unsigned long hits, bool singleShot)
 		{
 			AddrToHitsMap_t::iterator it;
@@ -509,6 +563,11 @@ private:
 			return m_lineId;
 		}
 
+		static uint64_t getLineId(uint64_t fileHash, unsigned int lineNr)
+		{
+			return (fileHash << 32ULL) | lineNr;
+		}
+
 		uint8_t *marshal(uint8_t *start, const Reporter &parent)
 		{
 			uint64_t *data = (uint64_t *)start;
@@ -700,12 +759,14 @@ private:
 	typedef std::unordered_map<uint64_t, Line *> LineIdToFileMap_t;
 	typedef std::vector<PendingFileAddress> PendingHitsList_t; // Address, hits
 	typedef std::unordered_map<uint64_t, PendingHitsList_t> PendingFilesMap_t;
+	typedef std::unordered_map<uint64_t, std::vector<uint64_t>> CoveredIndexMap_t; // Line ID -> address indexes
 
 	FileMap_t m_files;
 	AddrToLineMap_t m_addrToLine;
 	AddrToHitsMap_t m_pendingHits;
 	ListenerList_t m_listeners;
 	PendingFilesMap_t m_pendingFiles;
+	CoveredIndexMap_t m_coveredIndexes;
 	LineIdToFileMap_t m_lineIdToFileMap;
 	std::hash<std::string> m_fileHash;
 	bool m_hashFilename;
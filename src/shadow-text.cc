@@ -0,0 +1,148 @@
+#include <shadow-text.hh>
+#include <utils.hh>
+
+#include <map>
+#include <vector>
+#include <mutex>
+#include <string.h>
+#include <stdint.h>
+
+using namespace kcov;
+
+class ShadowText : public IShadowText
+{
+public:
+	ShadowText()
+	{
+	}
+
+	void addRegion(const std::string &module, unsigned long loadBase,
+			unsigned long addr, const void *data, size_t size, bool trusted)
+	{
+		if (size == 0)
+			return;
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		unsigned long end = addr + size;
+
+		// Drop regions from modules previously loaded at the same place
+		RegionMap_t::iterator it = m_regions.upper_bound(addr);
+		if (it != m_regions.begin())
+			--it;
+		while (it != m_regions.end() && it->first < end) {
+			if (it->second.m_end > addr)
+				m_regions.erase(it++);
+			else
+				++it;
+		}
+
+		Region &region = m_regions[addr];
+
+		region.m_end = end;
+		region.m_module = module;
+		region.m_trusted = trusted;
+		region.m_verifier = 0;
+		region.m_data.assign((const uint8_t *)data, (const uint8_t *)data + size);
+
+		kcov_debug(ELF_MSG, "shadow text for %s (base 0x%lx) at 0x%lx..0x%lx%s\n",
+				module.c_str(), loadBase, addr, end, trusted ? "" : " (untrusted)");
+	}
+
+	enum LookupResult lookup(pid_t pid, unsigned long addr, void *dst, size_t size)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		const Region *region = findRegion(addr);
+
+		if (!region || addr + size > region->m_end || !region->m_trusted)
+			return SHADOW_MISSING;
+
+		// Another process might have something else mapped here
+		if (region->m_verifier != 0 && region->m_verifier != pid)
+			return SHADOW_MISSING;
+
+		memcpy(dst, &region->m_data[addr - region->getStart()], size);
+
+		return region->m_verifier == pid ? SHADOW_VALID : SHADOW_UNVERIFIED;
+	}
+
+	bool getRegion(unsigned long addr, unsigned long &start, std::vector<uint8_t> &data)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		const Region *region = findRegion(addr);
+
+		if (!region || !region->m_trusted)
+			return false;
+
+		start = region->getStart();
+		data = region->m_data;
+
+		return true;
+	}
+
+	void setVerified(pid_t pid, unsigned long addr, bool matches)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		Region *region = findRegion(addr);
+
+		if (!region)
+			return;
+
+		if (!matches)
+			kcov_debug(ELF_MSG, "shadow text for %s at 0x%lx doesn't match process %d, not using it\n",
+					region->m_module.c_str(), region->getStart(), pid);
+
+		// Only the process which verified it can use it
+		region->m_verifier = matches ? pid : 0;
+		region->m_trusted = matches;
+	}
+
+private:
+	class Region
+	{
+	public:
+		Region() :
+			m_end(0), m_trusted(false), m_verifier(0)
+		{
+		}
+
+		unsigned long getStart() const
+		{
+			return m_end - m_data.size();
+		}
+
+		unsigned long m_end;
+		std::string m_module;
+		bool m_trusted;
+		pid_t m_verifier;
+		std::vector<uint8_t> m_data;
+	};
+
+	typedef std::map<unsigned long, Region> RegionMap_t;
+
+	Region *findRegion(unsigned long addr)
+	{
+		RegionMap_t::iterator it = m_regions.upper_bound(addr);
+
+		if (it == m_regions.begin())
+			return NULL;
+		--it;
+
+		if (addr >= it->second.m_end)
+			return NULL;
+
+		return &it->second;
+	}
+
+	std::mutex m_mutex;
+	RegionMap_t m_regions;
+};
+
+static ShadowText g_shadowText;
+IShadowText &IShadowText::getInstance()
+{
+	return g_shadowText;
+}
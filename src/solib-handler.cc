@@ -7,8 +7,9 @@
 #include <utils.hh>
 #include <phdr_data.h>
 #include <generated-data-base.hh>
+#include <spsc-ring.hh>
 
-#include <mutex>
+#include <atomic>
 #include <vector>
 #include <unordered_map>
 #include <signal.h>
@@ -16,6 +17,9 @@
 #include <fcntl.h>
 #include <sched.h>
 #include <pthread.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <stdlib.h>
@@ -33,10 +37,14 @@ public:
 		m_ldPreloadString(NULL),
 		m_envString(NULL),
 		m_solibFd(-1),
+		m_solibWriteFd(-1),
 		m_solibThreadValid(false),
 		m_threadShouldExit(false),
+		m_phdrRing(8),
+		m_reading(false),
 		m_parser(&parser),
-		m_hasSetupRelocation(false)
+		m_hasSetupRelocation(false),
+		m_owner(0)
 {
 		memset(&m_solibThread, 0, sizeof(m_solibThread));
 
@@ -55,13 +63,10 @@ public:
 			unlink(m_solibPath.c_str());
 		if (m_solibDirectory != "")
 			rmdir(m_solibDirectory.c_str());
-		if (m_solibFd >= 0)
-			close(m_solibFd);
 
 		/*
-		 * First kill the solib thread if it's stuck in open (i.e., before
-		 * the tracee has started), then wait for it to terminate for maximum
-		 * niceness.
+		 * First kill the solib thread, which is normally waiting in poll,
+		 * then wait for it to terminate for maximum niceness.
 		 *
 		 * Only do this if it has been started, naturally
 		 */
@@ -70,6 +75,11 @@ public:
 			pthread_kill(m_solibThread, SIGTERM);
 			pthread_join(m_solibThread, &rv);
 		}
+
+		if (m_solibFd >= 0)
+			close(m_solibFd);
+		if (m_solibWriteFd >= 0)
+			close(m_solibWriteFd);
 	}
 
 	// From IEventTickListener
@@ -92,10 +102,14 @@ public:
 				"libkcov_sowrapper.so";
 
 		// Skip this very special library
-		m_foundSolibs[get_real_path(kcov_solib_path)] = true;
+		m_wrapperPath = get_real_path(kcov_solib_path);
 
 		write_file(__library_data.data(), __library_data.size(), "%s", kcov_solib_path.c_str());
 
+		// The ptrace engine reads the solib list from the process instead
+		if (IConfiguration::getInstance().keyAsInt("solib-rendezvous"))
+			return;
+
 		unlink(kcov_solib_pipe_path.c_str());
 
 		int rv = mkfifo(kcov_solib_pipe_path.c_str(), 0644);
@@ -141,60 +155,145 @@ public:
 		putenv(m_envString);
 
 		m_solibPath = kcov_solib_pipe_path;
-		pthread_create(&m_solibThread, NULL,
-				SolibHandler::threadStatic, (void *)this);
+
+		/*
+		 * Opened here and not blocking, so that the tracer can read the data
+		 * at any time. kcov also keeps the FIFO open for writing, so that the
+		 * reader doesn't see EOF when the traced processes close it.
+		 */
+		m_solibFd = ::open(m_solibPath.c_str(), O_RDONLY | O_NONBLOCK);
+		if (m_solibFd < 0)
+			return;
+		m_solibWriteFd = ::open(m_solibPath.c_str(), O_WRONLY | O_NONBLOCK);
+
+		if (pthread_create(&m_solibThread, NULL,
+				SolibHandler::threadStatic, (void *)this) == 0)
+			m_solibThreadValid = true;
 
 	}
 
-	void solibThreadParse()
+	void solibThreadMain()
 	{
-		uint8_t buf[1024 * 1024];
+		struct pollfd pfd;
 
-		m_solibFd = ::open(m_solibPath.c_str(), O_RDONLY);
-		m_solibThreadValid = true;
+		pfd.fd = m_solibFd;
+		pfd.events = POLLIN;
 
-		if (m_solibFd < 0)
-			return;
+		while (1) {
+			if (m_threadShouldExit)
+				break;
+
+			// The destructor cancels the thread here
+			int r = poll(&pfd, 1, -1);
+			if (r < 0 && errno != EINTR)
+				break;
+
+			readFifo(false);
+		}
+	}
+
+	/*
+	 * Read everything which is in the FIFO now, and pass the complete
+	 * messages to the tracer through the ring. Only done by the solib
+	 * thread (or by the tracer if there is none), which is the producer.
+	 */
+	void readFifo(bool inTracer)
+	{
+		uint8_t buf[64 * 1024];
+		int oldState;
+
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState);
+		m_reading = true;
 
 		while (1) {
 			int r = read(m_solibFd, buf, sizeof(buf));
 
-			// The destructor will close m_solibFd, so we'll exit here in that case
 			if (r <= 0)
 				break;
 
-			panic_if ((unsigned)r >= sizeof(buf),
-					"Too much solib data read");
+			m_solibData.insert(m_solibData.end(), buf, buf + r);
+		}
 
-			struct phdr_data *p = phdr_data_unmarshal(buf);
+		size_t pos = 0;
 
-			if (p) {
-				size_t sz = sizeof(struct phdr_data) + p->n_entries * sizeof(struct phdr_data_entry);
-				struct phdr_data *cpy = (struct phdr_data*)xmalloc(sz);
+		while (pos < m_solibData.size()) {
+			ssize_t sz = phdr_data_message_size(&m_solibData[pos], m_solibData.size() - pos);
+			struct phdr_data *p = NULL;
 
-				memcpy(cpy, p, sz);
+			// The rest is still being written
+			if (sz == 0 || (sz > 0 && (size_t)sz > m_solibData.size() - pos))
+				break;
 
-				m_phdrListMutex.lock();
-				m_phdrs.push_back(cpy);
-				m_phdrListMutex.unlock();
+			if (sz > 0)
+				p = phdr_data_unmarshal(&m_solibData[pos], sz);
+
+			if (!p) {
+				warning("Broken solib data, dropping %zu bytes", m_solibData.size() - pos);
+				pos = m_solibData.size();
+				break;
 			}
-			m_solibDataReadSemaphore.notify();
+
+			// Full, wait for the tracer
+			while (!m_phdrRing.push(p)) {
+				if (inTracer) {
+					drainRing();
+				} else if (m_threadShouldExit) {
+					free(p);
+					break;
+				} else {
+					sched_yield();
+				}
+			}
+			pos += sz;
 		}
+		m_solibData.erase(m_solibData.begin(), m_solibData.begin() + pos);
 
-		m_solibDataReadSemaphore.notify();
-		close(m_solibFd);
+		m_reading = false;
+		pthread_setcancelstate(oldState, NULL);
 	}
 
-	void solibThreadMain()
+	/*
+	 * Called by the tracer when the tracee has forced a trap after writing
+	 * solib data. The write has completed, so the data is either still in
+	 * the FIFO or has been read by the solib thread, which is then busy
+	 * until it has queued it: Wait until neither is the case.
+	 */
+	void readSolibData()
 	{
+		if (!m_solibThreadValid) {
+			readFifo(true);
+			return;
+		}
+
 		while (1) {
-			if (m_threadShouldExit)
+			int pending = 0;
+
+			if (ioctl(m_solibFd, FIONREAD, &pending) < 0)
+				pending = 0;
+			if (pending == 0 && !m_reading)
 				break;
 
-			solibThreadParse();
+			// The thread might wait for space
+			drainRing();
+			sched_yield();
 		}
 	}
 
+	// From the tracer itself, so not through the ring
+	void queueSolibData(struct phdr_data *p)
+	{
+		m_phdrs.push_back(p);
+	}
+
+	// Consumer side, in the tracer
+	void drainRing()
+	{
+		struct phdr_data *p;
+
+		while (m_phdrRing.pop(p))
+			m_phdrs.push_back(p);
+	}
+
 	// Wrapper for ptrace
 	static void *threadStatic(void *pThis)
 	{
@@ -207,21 +306,62 @@ public:
 
 	void checkSolibData()
 	{
-		struct phdr_data *p = NULL;
-
 		if (!m_parser)
 			return;
 
-		m_phdrListMutex.lock();
-		if (!m_phdrs.empty()) {
-			p = m_phdrs.front();
-			m_phdrs.pop_front();
+		/*
+		 * Called on each tick, and there is nearly never anything queued.
+		 * The ring check is two loads, which are plain moves on x86.
+		 */
+		if (m_phdrRing.empty() && m_phdrs.empty())
+			return;
+
+		PhdrList_t phdrs;
+
+		drainRing();
+		phdrs.swap(m_phdrs);
+
+		IFileParser::SolibList_t solibs;
+		pid_t owner = 0;
+
+		/*
+		 * All of them at once, so that they can be parsed in parallel, but
+		 * separately for each process which has loaded them.
+		 */
+		for (PhdrList_t::iterator it = phdrs.begin();
+				it != phdrs.end();
+				++it) {
+			if ((*it)->pid != owner) {
+				parseSolibs(owner, solibs);
+				owner = (*it)->pid;
+			}
+
+			handleSolibData(*it, solibs);
 		}
-		m_phdrListMutex.unlock();
+		parseSolibs(owner, solibs);
+
+		for (PhdrList_t::iterator it = phdrs.begin();
+				it != phdrs.end();
+				++it)
+			free(*it);
+	}
 
-		if (!p)
+	// The breakpoints are registered for owner while parsing
+	void parseSolibs(pid_t owner, IFileParser::SolibList_t &solibs)
+	{
+		if (solibs.empty())
 			return;
 
+		m_owner = owner;
+		m_parser->parseSolibs(solibs);
+		m_owner = 0;
+
+		solibs.clear();
+	}
+
+	// Add the new solibs in p to solibs
+	void handleSolibData(struct phdr_data *p, IFileParser::SolibList_t &solibs)
+	{
 		// Setup where the main file is relocated once (for PIEs)
 		if (!m_hasSetupRelocation) {
 			m_hasSetupRelocation = true;
@@ -232,42 +372,52 @@ public:
 		{
 			struct phdr_data_entry *cur = &p->entries[i];
 
-			if (strlen(cur->name) == 0)
+			if (strlen(cur->name) == 0 || m_wrapperPath == cur->name)
 				continue;
 
-			if (m_foundSolibs.find(cur->name) != m_foundSolibs.end())
+			if (cur->flags & PHDR_DATA_UNLOADED) {
+				kcov_debug(INFO_MSG, "solib %s unloaded\n", cur->name);
 				continue;
+			}
 
-			m_parser->addFile(cur->name, cur);
-			m_parser->parse();
+			// Parsed again if loaded somewhere else after an unload
+			unsigned long base = cur->n_segments > 0 ? cur->segments[0].vaddr : 0;
+			FoundSolibsMap_t::iterator it = m_foundSolibs.find(cur->name);
 
-			m_foundSolibs[cur->name] = true;
-		}
+			if (it != m_foundSolibs.end() && it->second == base)
+				continue;
 
-		free(p);
+			solibs.push_back(cur);
+			m_foundSolibs[cur->name] = base;
+		}
 	}
 
 
 //private:
 
 	typedef std::list<struct phdr_data *> PhdrList_t;
-	typedef std::unordered_map<std::string, bool> FoundSolibsMap_t;
+	typedef std::vector<uint8_t> SolibData_t;
+	typedef std::unordered_map<std::string, unsigned long> FoundSolibsMap_t; // Name -> load address
 
 	std::string m_solibPath;
 	std::string m_solibDirectory;
 	char *m_ldPreloadString;
 	char *m_envString;
 	int m_solibFd;
+	int m_solibWriteFd;
 	bool m_solibThreadValid;
 	bool m_threadShouldExit;
 	pthread_t m_solibThread;
-	Semaphore m_solibDataReadSemaphore;
-	PhdrList_t m_phdrs;
+	SolibData_t m_solibData;
+	SpscRing<struct phdr_data *> m_phdrRing; // From the solib thread to the tracer
+	PhdrList_t m_phdrs; // Only used by the tracer
+	std::atomic<bool> m_reading; // The solib thread has data which isn't queued yet
 	FoundSolibsMap_t m_foundSolibs;
-	std::mutex m_phdrListMutex;
+	std::string m_wrapperPath;
 
 	IFileParser *m_parser;
 	bool m_hasSetupRelocation;
+	pid_t m_owner; // Of the solibs being parsed
 };
 
 
@@ -280,9 +430,19 @@ ISolibHandler &kcov::createSolibHandler(IFileParser &parser, ICollector &collect
 	return *g_handler;
 }
 
-void kcov::blockUntilSolibDataRead()
+void kcov::readSolibData()
 {
 	// If it has been started
-	if (g_handler->m_solibThreadValid)
-		g_handler->m_solibDataReadSemaphore.wait();
+	if (g_handler->m_solibFd >= 0)
+		g_handler->readSolibData();
+}
+
+void kcov::queueSolibData(struct phdr_data *p)
+{
+	g_handler->queueSolibData(p);
+}
+
+pid_t kcov::getSolibOwner()
+{
+	return g_handler ? g_handler->m_owner : 0;
 }
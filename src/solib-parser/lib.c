@@ -12,74 +12,190 @@
 #include <string.h>
 #include <unistd.h>
 #include <link.h>
+#include <limits.h>
 #include <dlfcn.h>
+#include <signal.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 
 #include <phdr_data.h>
+#include <trap_data.h>
 
-static struct phdr_data *phdr_data;
+static struct startup_trap_data *startup_trap_data;
+static struct trap_data_entry *trap_entries;
+static uint32_t trap_n_entries;
+static uint32_t *trap_bitmap;
+static struct sigaction trap_old_action; // The program's, chained to
+static int trap_handler_installed;
+static volatile int trap_lock;
+static unsigned long trap_page_size;
 
-static int phdrCallback(struct dl_phdr_info *info, size_t size, void *data)
+/* The protection of the executable mappings, to restore it after a write */
+struct trap_mapping
 {
-	// the first entry is used to determine the executable's "base address"
-	// (which is actually the relocation for PIE)
-	if (phdr_data->n_entries == 0) {
-		phdr_data->relocation = info->dlpi_addr;
+	unsigned long start;
+	unsigned long end;
+	int prot;
+};
+
+static struct trap_mapping *trap_mappings;
+static size_t trap_n_mappings;
+
+/* The objects which have been reported, to only send what has changed */
+struct known_object
+{
+	char *name;
+	unsigned long addr;
+	int seen;
+};
+
+static struct known_object *known_objects;
+static size_t n_known_objects;
+static size_t known_objects_allocated;
+static int sent_solibs;
+static pthread_mutex_t solib_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct known_object *find_known_object(struct dl_phdr_info *info)
+{
+	size_t i;
+
+	for (i = 0; i < n_known_objects; i++) {
+		struct known_object *cur = &known_objects[i];
+
+		if (cur->addr == info->dlpi_addr && strcmp(cur->name, info->dlpi_name) == 0)
+			return cur;
+	}
+
+	return NULL;
+}
+
+static int add_known_object(struct dl_phdr_info *info)
+{
+	struct known_object *cur;
+
+	if (n_known_objects == known_objects_allocated) {
+		size_t allocated = known_objects_allocated ? known_objects_allocated * 2 : 64;
+		struct known_object *p = realloc(known_objects, allocated * sizeof(*p));
+
+		if (!p)
+			return -1;
+
+		known_objects = p;
+		known_objects_allocated = allocated;
 	}
 
-	phdr_data_add(phdr_data, info);
+	cur = &known_objects[n_known_objects];
+	cur->name = strdup(info->dlpi_name);
+	if (!cur->name)
+		return -1;
+	cur->addr = info->dlpi_addr;
+	cur->seen = 1;
+	n_known_objects++;
 
 	return 0;
 }
 
-static int phdrSizeCallback(struct dl_phdr_info *info, size_t size, void *data)
+static int phdrCallback(struct dl_phdr_info *info, size_t size, void *data)
 {
-	size_t *ps = (size_t *)data;
+	struct phdr_data_message *msg = (struct phdr_data_message *)data;
+	struct known_object *known;
+
+	// the first entry is used to determine the executable's "base address"
+	// (which is actually the relocation for PIE)
+	if (!msg->data) {
+		phdr_data_message_init(msg, info->dlpi_addr);
+		return 0;
+	}
+
+	known = find_known_object(info);
+	if (known) {
+		known->seen = 1;
+		return 0;
+	}
 
-	*ps += sizeof(struct phdr_data_entry);
+	if (add_known_object(info) == 0)
+		phdr_data_message_add(msg, info);
 
 	return 0;
 }
 
+/*
+ * Send the objects which have been loaded or unloaded since the last time
+ * (everything the first time).
+ */
 static void parse_solibs(void)
 {
+	struct phdr_data_message msg;
 	char *kcov_solib_path;
-	void *p;
 	ssize_t written;
-	size_t allocSize;
-	size_t sz;
+	size_t i;
 	int fd;
 
 	kcov_solib_path = getenv("KCOV_SOLIB_PATH");
 	if (!kcov_solib_path)
 		return;
 
-	allocSize = sizeof(struct phdr_data);
-	dl_iterate_phdr(phdrSizeCallback, &allocSize);
+	pthread_mutex_lock(&solib_lock);
 
-	phdr_data = phdr_data_new(allocSize);
-	if (!phdr_data) {
-		fprintf(stderr, "kcov-solib: Can't allocate %zu bytes\n", allocSize);
-		return;
+	memset(&msg, 0, sizeof(msg));
+	dl_iterate_phdr(phdrCallback, &msg);
+
+	if (!msg.data) {
+		fprintf(stderr, "kcov-solib: Can't allocate solib data\n");
+		goto out_unlock;
 	}
 
+	for (i = 0; i < n_known_objects; ) {
+		struct known_object *cur = &known_objects[i];
 
-	dl_iterate_phdr(phdrCallback, NULL);
+		if (cur->seen) {
+			cur->seen = 0;
+			i++;
+			continue;
+		}
 
-	p = phdr_data_marshal(phdr_data, &sz);
+		phdr_data_message_add_unloaded(&msg, cur->name);
+		free(cur->name);
+		known_objects[i] = known_objects[--n_known_objects];
+	}
+
+	// Nothing has changed
+	if (sent_solibs && ((struct phdr_data_header *)msg.data)->n_records == 0)
+		goto out_free;
 
 	fd = open(kcov_solib_path, O_WRONLY);
 	if (fd < 0) {
 		fprintf(stderr, "kcov-solib: Can't open %s\n", kcov_solib_path);
-		return;
+		goto out_free;
 	}
-	written = write(fd, p, sz);
+	written = write(fd, msg.data, msg.size);
 
-	if (written != sz)
+	if (written != msg.size)
 		fprintf(stderr, "kcov-solib: Can't write to solib FIFO (%zu)\n", written);
-
-	phdr_data_free(p);
+	sent_solibs = 1;
 
 	close(fd);
+
+out_free:
+	phdr_data_message_free(&msg);
+out_unlock:
+	pthread_mutex_unlock(&solib_lock);
+}
+
+/*
+ * Held over fork(), so that the child doesn't get the lock (or the known
+ * objects) in the middle of an update by another thread.
+ */
+static void solib_lock_prepare(void)
+{
+	pthread_mutex_lock(&solib_lock);
+}
+
+static void solib_lock_release(void)
+{
+	pthread_mutex_unlock(&solib_lock);
 }
 
 static void force_breakpoint(void)
@@ -97,6 +213,590 @@ static void force_breakpoint(void)
 			);
 }
 
+static int is_traced(void)
+{
+	char buf[128];
+	FILE *fp;
+	int out = 0;
+
+	fp = fopen("/proc/self/status", "r");
+	if (!fp)
+		return 1;
+
+	while (fgets(buf, sizeof(buf), fp)) {
+		if (strncmp(buf, "TracerPid:", 10) == 0) {
+			out = strtol(buf + 10, NULL, 10) != 0;
+			break;
+		}
+	}
+	fclose(fp);
+
+	return out;
+}
+
+#if defined(__i386__) || defined(__x86_64__)
+/* Read the executable mappings from /proc/self/maps, which lists them sorted */
+static int read_mappings(void)
+{
+	size_t allocated = 0;
+	char buf[512];
+	FILE *fp;
+
+	fp = fopen("/proc/self/maps", "r");
+	if (!fp)
+		return -1;
+
+	trap_n_mappings = 0;
+	while (fgets(buf, sizeof(buf), fp)) {
+		unsigned long start, end;
+		char perms[5];
+		int prot = 0;
+
+		if (sscanf(buf, "%lx-%lx %4s", &start, &end, perms) != 3 || perms[2] != 'x')
+			continue;
+
+		if (trap_n_mappings == allocated) {
+			struct trap_mapping *p;
+
+			allocated = allocated ? allocated * 2 : 64;
+			p = realloc(trap_mappings, allocated * sizeof(*p));
+			if (!p) {
+				fclose(fp);
+				return -1;
+			}
+			trap_mappings = p;
+		}
+
+		if (perms[0] == 'r')
+			prot |= PROT_READ;
+		if (perms[1] == 'w')
+			prot |= PROT_WRITE;
+		prot |= PROT_EXEC;
+
+		trap_mappings[trap_n_mappings].start = start;
+		trap_mappings[trap_n_mappings].end = end;
+		trap_mappings[trap_n_mappings].prot = prot;
+		trap_n_mappings++;
+	}
+	fclose(fp);
+
+	return 0;
+}
+
+/* The protection of the mapping of page, or -1 if it's not executable */
+static int trap_page_prot(unsigned long page)
+{
+	long lo = 0;
+	long hi = (long)trap_n_mappings - 1;
+
+	while (lo <= hi) {
+		long mid = (lo + hi) / 2;
+		const struct trap_mapping *cur = &trap_mappings[mid];
+
+		if (page >= cur->end)
+			lo = mid + 1;
+		else if (page < cur->start)
+			hi = mid - 1;
+		else
+			return cur->prot;
+	}
+
+	return -1;
+}
+
+static int probeCallback(struct dl_phdr_info *info, size_t size, void *data)
+{
+	unsigned long *page = (unsigned long *)data;
+	int phdr;
+
+	for (phdr = 0; phdr < info->dlpi_phnum; phdr++) {
+		const ElfW(Phdr) *cur = &info->dlpi_phdr[phdr];
+
+		if (cur->p_type == PT_LOAD && (cur->p_flags & PF_X)) {
+			*page = (info->dlpi_addr + cur->p_vaddr) & ~(trap_page_size - 1);
+			break;
+		}
+	}
+
+	// Only the executable
+	return 1;
+}
+
+/*
+ * Check that the executable's text can be made writable, as the handler
+ * needs to. When it can't, leave a marker in place of the breakpoint table
+ * so that kcov keeps tracing with ptrace.
+ */
+static void probe_trap_handler(void)
+{
+	unsigned long page = 0;
+	char *path;
+	int prot;
+	int fd;
+
+	path = getenv("KCOV_TRAP_PATH");
+	if (!path)
+		return;
+
+	trap_page_size = sysconf(_SC_PAGESIZE);
+	dl_iterate_phdr(probeCallback, &page);
+
+	if (read_mappings() == 0 && page != 0 && (prot = trap_page_prot(page)) >= 0 &&
+			mprotect((void *)page, trap_page_size, prot | PROT_WRITE | PROT_EXEC) == 0) {
+		mprotect((void *)page, trap_page_size, prot);
+		return;
+	}
+
+	fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+	if (fd >= 0)
+		close(fd);
+
+	// Also for exec:ed children
+	unsetenv("KCOV_TRAP_PATH");
+}
+
+static int (*orig_sigaction)(int, const struct sigaction *, struct sigaction *);
+static sighandler_t (*orig_signal)(int, sighandler_t);
+
+// The libc sigaction(), since we interpose it
+static int real_sigaction(int sig, const struct sigaction *act, struct sigaction *oldact)
+{
+	if (!orig_sigaction)
+		orig_sigaction = dlsym(RTLD_NEXT, "sigaction");
+
+	return orig_sigaction(sig, act, oldact);
+}
+
+/*
+ * System calls for the signal handler, which doesn't call into libc: Its
+ * functions can have breakpoints as well.
+ */
+static inline long trap_syscall(long nr, long a, long b, long c)
+{
+	long out;
+
+#if defined(__x86_64__)
+	asm volatile("syscall"
+			: "=a"(out)
+			: "a"(nr), "D"(a), "S"(b), "d"(c)
+			: "rcx", "r11", "memory");
+#else
+	asm volatile("int $0x80"
+			: "=a"(out)
+			: "a"(nr), "b"(a), "c"(b), "d"(c)
+			: "memory");
+#endif
+
+	return out;
+}
+
+static long trap_lookup(unsigned long addr)
+{
+	long lo = 0;
+	long hi = (long)trap_n_entries - 1;
+
+	while (lo <= hi) {
+		long mid = (lo + hi) / 2;
+		unsigned long cur = trap_entries[mid].addr;
+
+		if (cur == addr)
+			return mid;
+		if (cur < addr)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+
+	return -1;
+}
+
+/* Returns 0 if the byte was restored, -1 if the text can't be written */
+static int trap_restore(unsigned long addr, uint8_t orig)
+{
+	unsigned long page = addr & ~(trap_page_size - 1);
+	int prot = trap_page_prot(page);
+	int out = -1;
+
+	if (prot < 0)
+		return -1;
+
+	while (__sync_lock_test_and_set(&trap_lock, 1))
+		;
+
+	if (trap_syscall(SYS_mprotect, page, trap_page_size, prot | PROT_WRITE | PROT_EXEC) == 0) {
+		*(volatile uint8_t *)addr = orig;
+		trap_syscall(SYS_mprotect, page, trap_page_size, prot);
+		out = 0;
+	}
+
+	__sync_lock_release(&trap_lock);
+
+	return out;
+}
+
+/*
+ * The int3 is still there, so returning would just trap again. Only raw
+ * system calls in here, as in trap_restore().
+ */
+static void trap_fail(void)
+{
+	static const char msg[] =
+			"kcov-solib: Can't make the program text writable to remove a breakpoint "
+			"(W^X, SELinux execmem or PaX?), exiting. Run kcov without --trap-handler\n";
+
+	trap_n_entries = 0;
+	trap_syscall(SYS_write, STDERR_FILENO, (long)msg, sizeof(msg) - 1);
+	trap_syscall(SYS_exit_group, 1, 0, 0);
+}
+
+static void trap_handler(int sig, siginfo_t *info, void *ctx)
+{
+	ucontext_t *uc = (ucontext_t *)ctx;
+#if defined(__x86_64__)
+	greg_t *pc = &uc->uc_mcontext.gregs[REG_RIP];
+#else
+	greg_t *pc = &uc->uc_mcontext.gregs[REG_EIP];
+#endif
+	unsigned long addr = (unsigned long)*pc - 1;
+	long idx = trap_lookup(addr);
+	uint32_t bit;
+
+	if (idx < 0) {
+		// Not ours, pass it on
+		if (trap_old_action.sa_flags & SA_SIGINFO) {
+			trap_old_action.sa_sigaction(sig, info, ctx);
+		} else if (trap_old_action.sa_handler == SIG_DFL) {
+			// Kills us
+			real_sigaction(SIGTRAP, &trap_old_action, NULL);
+			raise(SIGTRAP);
+		} else if (trap_old_action.sa_handler != SIG_IGN) {
+			trap_old_action.sa_handler(sig);
+		}
+
+		return;
+	}
+
+	bit = trap_entries[idx].bit;
+	__sync_fetch_and_or(&trap_bitmap[bit / 32], 1U << (bit % 32));
+	if (trap_restore(addr, (uint8_t)trap_entries[idx].orig_byte) < 0)
+		trap_fail();
+
+	// Execute the original instruction
+	*pc = (greg_t)addr;
+}
+
+/*
+ * SA_NODEFER, since code which the handler runs can have breakpoints as
+ * well: The program's handler which it passes other traps on to, and the
+ * libc functions that calls. A trap with SIGTRAP blocked would kill us.
+ */
+static int install_trap_handler(void)
+{
+	struct sigaction sa;
+
+	trap_page_size = sysconf(_SC_PAGESIZE);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = trap_handler;
+	sa.sa_flags = SA_SIGINFO | SA_RESTART | SA_NODEFER;
+	sigemptyset(&sa.sa_mask);
+
+	if (real_sigaction(SIGTRAP, &sa, &trap_old_action) < 0) {
+		fprintf(stderr, "kcov-solib: Can't install SIGTRAP handler\n");
+		return -1;
+	}
+	trap_handler_installed = 1;
+
+	return 0;
+}
+
+/*
+ * The program can't replace the handler, which would then get the
+ * remaining breakpoints: Its handler is instead the one we pass other
+ * traps on to.
+ */
+int sigaction(int sig, const struct sigaction *act, struct sigaction *oldact)
+{
+	struct sigaction old;
+
+	if (sig != SIGTRAP || !trap_handler_installed)
+		return real_sigaction(sig, act, oldact);
+
+	old = trap_old_action;
+	if (act)
+		trap_old_action = *act;
+	if (oldact)
+		*oldact = old;
+
+	return 0;
+}
+
+sighandler_t signal(int sig, sighandler_t handler)
+{
+	struct sigaction sa;
+	struct sigaction old;
+
+	if (sig != SIGTRAP || !trap_handler_installed) {
+		if (!orig_signal)
+			orig_signal = dlsym(RTLD_NEXT, "signal");
+
+		return orig_signal(sig, handler);
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handler;
+	sa.sa_flags = SA_RESTART;
+
+	if (sigaction(sig, &sa, &old) < 0)
+		return SIG_ERR;
+
+	return old.sa_handler;
+}
+
+static void *map_shared_file(int fd, size_t *out_size)
+{
+	struct stat st;
+	void *p;
+
+	if (fstat(fd, &st) < 0)
+		return NULL;
+
+	p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+
+	*out_size = st.st_size;
+
+	return p;
+}
+
+static void setup_trap_handler(void)
+{
+	struct trap_data *p;
+	size_t sz;
+	char *path;
+	int fd;
+
+	path = getenv("KCOV_TRAP_PATH");
+	if (!path)
+		return;
+
+	fd = open(path, O_RDWR);
+	if (fd < 0)
+		return;
+
+	p = map_shared_file(fd, &sz);
+	close(fd);
+	if (!p)
+		return;
+
+	// Written for some other process (e.g., before an exec)
+	if (sz < sizeof(struct trap_data) ||
+			p->magic != KCOV_TRAP_MAGIC || p->version != KCOV_TRAP_VERSION ||
+			p->pid != getpid() || trap_data_size(p->n_entries) > sz) {
+		munmap(p, sz);
+		return;
+	}
+
+	trap_entries = p->entries;
+	trap_n_entries = p->n_entries;
+	trap_bitmap = trap_data_bitmap(p);
+
+	if (install_trap_handler() < 0)
+		return;
+
+	// kcov detaches here
+	__sync_synchronize();
+	p->ready = 1;
+	force_breakpoint();
+}
+
+static int trap_entry_cmp(const void *a, const void *b)
+{
+	const struct trap_data_entry *pa = (const struct trap_data_entry *)a;
+	const struct trap_data_entry *pb = (const struct trap_data_entry *)b;
+
+	if (pa->addr < pb->addr)
+		return -1;
+
+	return pa->addr > pb->addr;
+}
+
+/* Add the breakpoints of a segment to the table, without writing them yet */
+static void startup_add_segment(struct dl_phdr_info *info, const ElfW(Phdr) *phdr,
+		const struct startup_trap_module *mod)
+{
+	unsigned long *offsets = startup_trap_data_offsets(startup_trap_data) + mod->first_entry;
+	uint32_t i;
+
+	for (i = 0; i < mod->n_entries; i++) {
+		unsigned long off = offsets[i];
+		struct trap_data_entry *cur;
+		uint8_t *addr;
+
+		if (off < phdr->p_vaddr || off >= phdr->p_vaddr + phdr->p_memsz)
+			continue;
+
+		addr = (uint8_t *)(info->dlpi_addr + off);
+		cur = &trap_entries[trap_n_entries++];
+
+		cur->addr = (unsigned long)addr;
+		cur->orig_byte = *addr;
+		cur->bit = mod->first_entry + i;
+	}
+}
+
+/*
+ * Write the (sorted) breakpoints one page at a time, with the page made
+ * writable only while doing that. The handler is installed, and only raw
+ * system calls are used, since libc can have breakpoints as well.
+ *
+ * Returns the number of breakpoints on pages which can't be made
+ * writable. They are left out, since the handler couldn't remove them
+ * either.
+ */
+static uint32_t startup_arm(void)
+{
+	unsigned long page = 0;
+	uint32_t n_skipped = 0;
+	int prot = -1;
+	uint32_t i;
+
+	for (i = 0; i < trap_n_entries; i++) {
+		uint8_t *addr = (uint8_t *)trap_entries[i].addr;
+
+		if (((unsigned long)addr & ~(trap_page_size - 1)) != page) {
+			if (prot >= 0)
+				trap_syscall(SYS_mprotect, page, trap_page_size, prot);
+
+			page = (unsigned long)addr & ~(trap_page_size - 1);
+			prot = trap_page_prot(page);
+			if (prot >= 0 &&
+					trap_syscall(SYS_mprotect, page, trap_page_size, prot | PROT_WRITE | PROT_EXEC) != 0)
+				prot = -1;
+		}
+
+		if (prot < 0) {
+			n_skipped++;
+			continue;
+		}
+
+		*addr = 0xcc; // int3
+	}
+
+	if (prot >= 0)
+		trap_syscall(SYS_mprotect, page, trap_page_size, prot);
+
+	return n_skipped;
+}
+
+static int startupArmCallback(struct dl_phdr_info *info, size_t size, void *data)
+{
+	int *n_seen = (int *)data;
+	char path[PATH_MAX];
+	const char *name = info->dlpi_name;
+	uint32_t i;
+	int phdr;
+
+	// The first entry is the executable itself
+	if ((*n_seen)++ == 0) {
+		ssize_t len = readlink("/proc/self/exe", path, sizeof(path) - 1);
+
+		if (len < 0)
+			return 0;
+		path[len] = '\0';
+	} else if (!name || !realpath(name, path)) {
+		return 0;
+	}
+
+	for (i = 0; i < startup_trap_data->n_modules; i++) {
+		const struct startup_trap_module *mod = &startup_trap_data->modules[i];
+
+		if (strcmp(mod->name, path) != 0)
+			continue;
+
+		for (phdr = 0; phdr < info->dlpi_phnum; phdr++) {
+			const ElfW(Phdr) *cur = &info->dlpi_phdr[phdr];
+
+			if (cur->p_type == PT_LOAD && (cur->p_flags & PF_X))
+				startup_add_segment(info, cur, mod);
+		}
+		break;
+	}
+
+	return 0;
+}
+
+/*
+ * Trap handler mode armed at startup: Set up breakpoints ourselves from the
+ * module-relative list kcov has written. No tracer is involved.
+ */
+static void setup_startup_traps(void)
+{
+	struct startup_trap_data *p;
+	uint32_t n_skipped;
+	int n_seen = 0;
+	size_t sz;
+	char *fd_str;
+
+	fd_str = getenv("KCOV_STARTUP_TRAP_FD");
+	if (!fd_str)
+		return;
+
+	p = map_shared_file(atoi(fd_str), &sz);
+	if (!p)
+		return;
+
+	if (sz < sizeof(struct startup_trap_data) ||
+			p->magic != KCOV_STARTUP_TRAP_MAGIC || p->version != KCOV_STARTUP_TRAP_VERSION ||
+			startup_trap_data_size(p->n_modules, p->n_entries) > sz) {
+		munmap(p, sz);
+		return;
+	}
+
+	// For trap_restore(), which puts back the original protection
+	if (read_mappings() < 0)
+		return;
+
+	trap_entries = mmap(NULL, p->n_entries * sizeof(struct trap_data_entry) + 1,
+			PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (trap_entries == MAP_FAILED) {
+		trap_entries = NULL;
+		return;
+	}
+
+	trap_page_size = sysconf(_SC_PAGESIZE);
+
+	startup_trap_data = p;
+	trap_n_entries = 0;
+	trap_bitmap = startup_trap_data_bitmap(p);
+
+	dl_iterate_phdr(startupArmCallback, &n_seen);
+	qsort(trap_entries, trap_n_entries, sizeof(struct trap_data_entry), trap_entry_cmp);
+
+	// Before any breakpoint is written, since libc can have them as well
+	if (install_trap_handler() < 0)
+		return;
+
+	n_skipped = startup_arm();
+	if (n_skipped)
+		fprintf(stderr, "kcov-solib: Can't make the program text writable, %u breakpoints left out\n",
+				n_skipped);
+}
+#else
+static void probe_trap_handler(void)
+{
+}
+
+static void setup_trap_handler(void)
+{
+}
+
+static void setup_startup_traps(void)
+{
+}
+#endif
+
 static void *(*orig_dlopen)(const char *, int);
 void *dlopen(const char *filename, int flag)
 {
@@ -107,8 +807,14 @@ void *dlopen(const char *filename, int flag)
 
 	out = orig_dlopen(filename, flag);
 
+	// kcov has detached (or never attached), so nobody would catch the trap
+	if (trap_entries)
+		return out;
+
 	parse_solibs();
-	force_breakpoint();
+	// Not after --early-detach, but the new solib is still reported
+	if (is_traced())
+		force_breakpoint();
 
 	return out;
 }
@@ -116,6 +822,21 @@ void *dlopen(const char *filename, int flag)
 
 void  __attribute__((constructor))kcov_solib_at_startup(void)
 {
+	pthread_atfork(solib_lock_prepare, solib_lock_release, solib_lock_release);
+
+	if (getenv("KCOV_STARTUP_TRAP_FD")) {
+		setup_startup_traps();
+		return;
+	}
+
+	// In trap handler mode, exec:ed children are no longer traced
+	if (getenv("KCOV_TRAP_PATH") && !is_traced())
+		return;
+
+	probe_trap_handler();
+
 	parse_solibs();
 	force_breakpoint();
+
+	setup_trap_handler();
 }
@@ -10,83 +10,217 @@
 #include <link.h>
 
 #define KCOV_MAGIC         0x6b636f76 /* "kcov" */
-#define KCOV_SOLIB_VERSION 3
+#define KCOV_SOLIB_VERSION 5
 
-static uint8_t data_area[4 * 1024 * 1024];
+/* Silly sizes mean broken data */
+#define MAX_MESSAGE_SIZE   (256 * 1024 * 1024)
 
-struct phdr_data *phdr_data_new(size_t allocSize)
+#define MAX_SEGMENTS (sizeof(((struct phdr_data_entry *)0)->segments) / sizeof(struct phdr_data_segment))
+
+static size_t pad(size_t size)
 {
-	struct phdr_data *p = (struct phdr_data *)data_area;
+	return (size + 7) & ~7;
+}
 
-	if (allocSize > sizeof(data_area))
-		return NULL;
+static struct phdr_data_header *get_header(struct phdr_data_message *msg)
+{
+	return (struct phdr_data_header *)msg->data;
+}
+
+/* Returns a zeroed record of size bytes at the end of the message */
+static struct phdr_data_record *add_record(struct phdr_data_message *msg, size_t size)
+{
+	struct phdr_data_record *out;
+
+	size = pad(size);
+	if (msg->size + size > msg->allocated) {
+		size_t allocated = msg->allocated * 2;
+		uint8_t *p;
+
+		if (allocated < msg->size + size)
+			allocated = msg->size + size;
+
+		p = realloc(msg->data, allocated);
+		if (!p)
+			return NULL;
+
+		msg->data = p;
+		msg->allocated = allocated;
+	}
+
+	out = (struct phdr_data_record *)(msg->data + msg->size);
+	memset(out, 0, size);
+	out->size = size;
 
-	p->magic = KCOV_MAGIC;
-	p->version = KCOV_SOLIB_VERSION;
-	p->relocation = 0;
-	p->n_entries = 0;
+	msg->size += size;
+	get_header(msg)->size = msg->size;
+	get_header(msg)->n_records++;
 
-	return p;
+	return out;
 }
 
-void phdr_data_free(struct phdr_data *p)
+void phdr_data_message_init(struct phdr_data_message *msg, unsigned long relocation)
 {
-}
+	struct phdr_data_header *hdr;
+
+	msg->allocated = 16 * 1024;
+	msg->data = malloc(msg->allocated);
+	msg->size = sizeof(struct phdr_data_header);
 
+	if (!msg->data) {
+		msg->allocated = 0;
+		return;
+	}
 
-void phdr_data_add(struct phdr_data *p, struct dl_phdr_info *info)
+	hdr = get_header(msg);
+	hdr->magic = KCOV_MAGIC;
+	hdr->version = KCOV_SOLIB_VERSION;
+	hdr->size = msg->size;
+	hdr->n_records = 0;
+	hdr->pid = getpid();
+	hdr->reserved = 0;
+	hdr->relocation = relocation;
+}
+
+int phdr_data_message_add(struct phdr_data_message *msg, struct dl_phdr_info *info)
 {
-	uint32_t n = p->n_entries + 1;
-	uint32_t curEntry = p->n_entries;
+	struct phdr_data_record *cur;
+	unsigned int n_segments = 0;
+	size_t name_len = strlen(info->dlpi_name) + 1;
 	int phdr;
 
-	struct phdr_data_entry *cur = &p->entries[curEntry];
-
-	memset(cur, 0, sizeof(*cur));
-	strncpy(cur->name, info->dlpi_name, sizeof(cur->name) - 1);
+	if (!msg->data)
+		return -1;
 
-	cur->n_segments = 0;
 	for (phdr = 0; phdr < info->dlpi_phnum; phdr++) {
+		if (info->dlpi_phdr[phdr].p_type == PT_LOAD)
+			n_segments++;
+	}
+
+	if (n_segments > MAX_SEGMENTS) {
+		fprintf(stderr, "Too many segments\n");
+		n_segments = MAX_SEGMENTS;
+	}
+
+	cur = add_record(msg, sizeof(*cur) + n_segments * sizeof(struct phdr_data_segment) + name_len);
+	if (!cur)
+		return -1;
+
+	for (phdr = 0; phdr < info->dlpi_phnum && cur->n_segments < n_segments; phdr++) {
 		const ElfW(Phdr) *curHdr = &info->dlpi_phdr[phdr];
 		struct phdr_data_segment *seg = &cur->segments[cur->n_segments];
 
 		if (curHdr->p_type != PT_LOAD)
 			continue;
 
-		if (cur->n_segments >= sizeof(cur->segments) / sizeof(cur->segments[0]))
-		{
-			fprintf(stderr, "Too many segments\n");
-			return;
-		}
-
 		seg->paddr = curHdr->p_paddr;
 		seg->vaddr = info->dlpi_addr + curHdr->p_vaddr;
 		seg->size = curHdr->p_memsz;
 
 		cur->n_segments++;
 	}
+	memcpy(&cur->segments[n_segments], info->dlpi_name, name_len);
+
+	return 0;
+}
+
+int phdr_data_message_add_unloaded(struct phdr_data_message *msg, const char *name)
+{
+	struct phdr_data_record *cur;
+	size_t name_len = strlen(name) + 1;
+
+	if (!msg->data)
+		return -1;
+
+	cur = add_record(msg, sizeof(*cur) + name_len);
+	if (!cur)
+		return -1;
+
+	cur->flags = PHDR_DATA_UNLOADED;
+	memcpy(&cur->segments[0], name, name_len);
 
-	p->n_entries = n;
+	return 0;
 }
 
-void *phdr_data_marshal(struct phdr_data *p, size_t *out_sz)
+void phdr_data_message_free(struct phdr_data_message *msg)
 {
-	*out_sz = sizeof(struct phdr_data) + sizeof(struct phdr_data_entry) * p->n_entries;
+	free(msg->data);
+	msg->data = NULL;
+	msg->size = 0;
+	msg->allocated = 0;
+}
+
+ssize_t phdr_data_message_size(const void *data, size_t size)
+{
+	const struct phdr_data_header *hdr = (const struct phdr_data_header *)data;
 
-	return (void *)p;
+	if (size < sizeof(*hdr))
+		return 0;
+
+	if (hdr->magic != KCOV_MAGIC || hdr->version != KCOV_SOLIB_VERSION ||
+			hdr->size < sizeof(*hdr) || hdr->size > MAX_MESSAGE_SIZE)
+		return -1;
+
+	return hdr->size;
 }
 
-struct phdr_data *phdr_data_unmarshal(void *p)
+struct phdr_data *phdr_data_unmarshal(const void *data, size_t size)
 {
-	struct phdr_data *out = (struct phdr_data *)p;
+	const struct phdr_data_header *hdr = (const struct phdr_data_header *)data;
+	const uint8_t *p = (const uint8_t *)data + sizeof(*hdr);
+	const uint8_t *end = (const uint8_t *)data + size;
+	struct phdr_data *out;
+	uint32_t i;
 
-	if (out->magic != KCOV_MAGIC)
+	if (phdr_data_message_size(data, size) != (ssize_t)size)
 		return NULL;
-	if (out->version != KCOV_SOLIB_VERSION)
+
+	// Each record is at least the size of the record header
+	if (hdr->n_records > (size - sizeof(*hdr)) / sizeof(struct phdr_data_record))
 		return NULL;
-	// Silly amounts of entries mean broken data
-	if (out->n_entries > 0x10000)
+
+	out = malloc(sizeof(*out) + hdr->n_records * sizeof(struct phdr_data_entry));
+	if (!out)
 		return NULL;
 
+	out->magic = hdr->magic;
+	out->version = hdr->version;
+	out->relocation = hdr->relocation;
+	out->pid = hdr->pid;
+	out->n_entries = hdr->n_records;
+
+	for (i = 0; i < hdr->n_records; i++) {
+		const struct phdr_data_record *rec = (const struct phdr_data_record *)p;
+		struct phdr_data_entry *cur = &out->entries[i];
+		size_t fixed;
+		const char *name;
+		size_t name_len;
+
+		if ((size_t)(end - p) < sizeof(*rec) || rec->size > (size_t)(end - p))
+			goto broken;
+
+		fixed = sizeof(*rec) + rec->n_segments * sizeof(struct phdr_data_segment);
+		if (rec->n_segments > MAX_SEGMENTS || fixed >= rec->size)
+			goto broken;
+
+		name = (const char *)p + fixed;
+		name_len = strnlen(name, rec->size - fixed);
+		if (name_len == rec->size - fixed || name_len >= sizeof(cur->name))
+			goto broken;
+
+		memset(cur, 0, sizeof(*cur));
+		memcpy(cur->name, name, name_len);
+		cur->flags = rec->flags;
+		cur->n_segments = rec->n_segments;
+		memcpy(cur->segments, rec->segments, rec->n_segments * sizeof(struct phdr_data_segment));
+
+		p += rec->size;
+	}
+
 	return out;
+
+broken:
+	free(out);
+
+	return NULL;
 }
@@ -20,6 +20,7 @@
 #include <fstream>
 #include <stdexcept>
 #include <algorithm>
+#include <mutex>
 #include <unordered_map>
 
 int g_kcov_debug_mask = STATUS_MSG;
@@ -252,13 +253,16 @@ bool file_readable(FILE *fp, unsigned int ms)
 	return rv > 0;
 }
 
+// The caches are also used from the ELF parser workers
 static std::unordered_map<std::string, bool> statCache;
+static std::mutex statCacheMutex;
 
 bool file_exists(const std::string &path)
 {
 	if (mocked_file_exists_callback)
 		return mocked_file_exists_callback(path);
 
+	std::lock_guard<std::mutex> lock(statCacheMutex);
 	bool out;
 
 	if (statCache.find(path) == statCache.end()) {
@@ -465,8 +469,11 @@ std::string trim_string(const std::string &strIn)
 // Cache for ::realpath - it's apparently one of the reasons why kcov is slow
 typedef std::unordered_map<std::string, std::string> PathMap_t;
 static PathMap_t realPathCache;
+static std::mutex realPathCacheMutex;
 const std::string &get_real_path(const std::string &path)
 {
+	// References to the elements stay valid when the map grows
+	std::lock_guard<std::mutex> lock(realPathCacheMutex);
 	PathMap_t::const_iterator it = realPathCache.find(path);
 	if (it != realPathCache.end())
 		return it->second;
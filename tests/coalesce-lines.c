@@ -0,0 +1,14 @@
+#include <stdio.h>
+
+int main(int argc, const char *argv[])
+{
+	volatile int sum = 0;
+	int i;
+
+	// One line with several addresses, which are all executed many times
+	for (i = 0; i < 100; i++) sum += i;
+
+	printf("%d\n", sum);
+
+	return 0;
+}
@@ -0,0 +1,50 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+/*
+ * Forks and starts a thread over and over, for the tests which detach
+ * from a running program. Every line is hit in the first round, and the
+ * status file has the number of rounds and of children which crashed.
+ */
+static void *thread_main(void *arg)
+{
+	return arg;
+}
+
+static int child_main(unsigned long round)
+{
+	return round & 1;
+}
+
+int main(int argc, const char *argv[])
+{
+	unsigned long rounds = 0;
+	unsigned long crashed = 0;
+	int fd = open(argv[1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	while (1) {
+		pthread_t thread;
+		char buf[64];
+		int status = 0;
+		pid_t pid = fork();
+
+		if (pid == 0)
+			_exit(child_main(rounds));
+
+		pthread_create(&thread, NULL, thread_main, NULL);
+		pthread_join(thread, NULL);
+
+		waitpid(pid, &status, 0);
+		crashed += WIFSIGNALED(status) != 0;
+		rounds++;
+
+		snprintf(buf, sizeof(buf), "%lu %lu\n", rounds, crashed);
+		pwrite(fd, buf, strlen(buf), 0);
+		usleep(1000);
+	}
+}
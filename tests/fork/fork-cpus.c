@@ -0,0 +1,48 @@
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define N_CHILDREN 4
+
+// Prints the number of CPUs each process may run on
+static void report(const char *who)
+{
+	cpu_set_t set;
+
+	if (sched_getaffinity(0, sizeof(set), &set) < 0) {
+		printf("%s: no affinity\n", who);
+		return;
+	}
+
+	printf("%s CPUs: %d\n", who, CPU_COUNT(&set));
+	fflush(stdout);
+}
+
+int main(int argc, const char *argv[])
+{
+	int i;
+
+	report("parent");
+
+	for (i = 0; i < N_CHILDREN; i++) {
+		pid_t child = fork();
+
+		if (child < 0) {
+			fprintf(stderr, "fork failed!\n");
+			return 1;
+		}
+
+		if (child == 0) {
+			report("child");
+			return 0;
+		}
+	}
+
+	for (i = 0; i < N_CHILDREN; i++)
+		wait(NULL);
+
+	return 0;
+}
@@ -0,0 +1,104 @@
+#include <dlfcn.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define N_CHILDREN 4
+#define N_SIGNALS 2000
+
+static volatile int n_signals;
+
+static void handler(int sig)
+{
+	n_signals++;
+}
+
+// Each signal is a stop in kcov, so the stops of the children are handled together
+static int make_stops(void)
+{
+	int i;
+
+	signal(SIGUSR1, handler);
+	for (i = 0; i < N_SIGNALS; i++)
+		raise(SIGUSR1);
+
+	return n_signals != N_SIGNALS;
+}
+
+// In the first child, which is not the last one kcov sees stopped
+static int load_solib(const char *path)
+{
+	void *handle;
+	int (*sym)(int);
+
+	usleep(5000);
+
+	handle = dlopen(path, RTLD_NOW);
+	if (!handle) {
+		printf("Can't dlopen %s\n", path);
+		return 1;
+	}
+
+	sym = (int (*)(int))dlsym(handle, "vobb");
+	if (!sym) {
+		printf("No symbol\n");
+		return 1;
+	}
+
+	printf("from shared lib: %d\n", sym(5));
+
+	return 0;
+}
+
+int main(int argc, const char *argv[])
+{
+	int out = 0;
+	int fds[2];
+	int i;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: fork-dlopen solib\n");
+		return 1;
+	}
+
+	if (pipe(fds) < 0)
+		return 1;
+
+	for (i = 0; i < N_CHILDREN; i++) {
+		pid_t child = fork();
+		char c;
+
+		if (child < 0) {
+			fprintf(stderr, "fork failed!\n");
+			return 1;
+		}
+
+		if (child == 0) {
+			// Wait until all of them are there
+			close(fds[1]);
+			if (read(fds[0], &c, 1) < 0)
+				return 1;
+
+			if (i == 0)
+				return load_solib(argv[1]);
+
+			return make_stops();
+		}
+	}
+
+	// EOF starts them
+	close(fds[0]);
+	close(fds[1]);
+
+	for (i = 0; i < N_CHILDREN; i++) {
+		int status;
+
+		if (wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			out = 1;
+	}
+
+	return out;
+}
@@ -2,6 +2,8 @@ import testbase
 import unittest
 import parse_cobertura
 import os
+import subprocess
+import time
 
 class illegal_insn(testbase.KcovTestCase):
     def runTest(self):
@@ -23,10 +25,10 @@ class fork_no_wait(testbase.KcovTestCase):
         assert parse_cobertura.hitsPerLine(dom, "fork-no-wait.c", 24) >= 1
 
 class ForkBase(testbase.KcovTestCase):
-    def doTest(self, binary):
+    def doTest(self, binary, options = ""):
         self.setUp()
         noKcovRv,o = self.do(testbase.testbuild + "/" + binary, False)
-        rv,o = self.do(testbase.kcov + " " + testbase.outbase + "/kcov " + testbase.testbuild + "/" + binary, False)
+        rv,o = self.do(testbase.kcov + " " + options + " " + testbase.outbase + "/kcov " + testbase.testbuild + "/" + binary, False)
         assert rv == noKcovRv
 
         dom = parse_cobertura.parseFile(testbase.outbase + "/kcov/" + binary + "/cobertura.xml")
@@ -44,6 +46,42 @@ class fork_32(ForkBase):
     def runTest(self):
         self.doTest("fork-32")
 
+class fork_propagate_hits(ForkBase):
+    def runTest(self):
+        self.doTest("fork", "--propagate-hits")
+
+class fork_cpus(testbase.KcovTestCase):
+    def cpuCounts(self, cmdline):
+        rv,o = self.do(cmdline, False)
+        assert rv == 0
+
+        return [int(line.split(":")[1]) for line in o.decode().split("\n") if line.find("CPUs:") != -1]
+
+    def runTest(self):
+        self.setUp()
+        kcov = testbase.kcov + " %s " + testbase.outbase + "/kcov " + testbase.testbuild + "/fork-cpus"
+        available = self.cpuCounts(testbase.testbuild + "/fork-cpus")[0]
+
+        # The parent and all the children may use every CPU
+        assert self.cpuCounts(kcov % "") == [available] * 5
+
+        if available > 1:
+            assert self.cpuCounts(kcov % "--pin-cpu") == [1] * 5
+
+class fork_dlopen(testbase.KcovTestCase):
+    def runTest(self):
+        self.setUp()
+        cmdline = testbase.testbuild + "/fork-dlopen " + testbase.testbuild + "/libshared_library.so"
+        noKcovRv,o = self.do(cmdline, False)
+        rv,o = self.do(testbase.kcov + " " + testbase.outbase + "/kcov " + cmdline, False)
+        assert rv == noKcovRv
+
+        # Loaded in one child while the others stop all the time
+        dom = parse_cobertura.parseFile(testbase.outbase + "/kcov/fork-dlopen/cobertura.xml")
+        assert parse_cobertura.hitsPerLine(dom, "fork-dlopen.c", 26) >= 1
+        assert parse_cobertura.hitsPerLine(dom, "solib.c", 5) == 1
+        assert parse_cobertura.hitsPerLine(dom, "solib.c", 17) == 0
+
 class vfork(testbase.KcovTestCase):
     def runTest(self):
         self.setUp()
@@ -65,6 +103,17 @@ class shared_library(testbase.KcovTestCase):
         assert parse_cobertura.hitsPerLine(dom, "main.c", 9) == 1
         assert parse_cobertura.hitsPerLine(dom, "solib.c", 5) == 1
 
+class shared_library_rendezvous(testbase.KcovTestCase):
+    def runTest(self):
+        self.setUp()
+        noKcovRv,o = self.do(testbase.testbuild + "/shared_library_test", False)
+        rv,o = self.do(testbase.kcov + " --solib-rendezvous " + testbase.outbase + "/kcov " + testbase.testbuild + "/shared_library_test", False)
+        assert rv == noKcovRv
+
+        dom = parse_cobertura.parseFile(testbase.outbase + "/kcov/shared_library_test/cobertura.xml")
+        assert parse_cobertura.hitsPerLine(dom, "main.c", 9) == 1
+        assert parse_cobertura.hitsPerLine(dom, "solib.c", 5) == 1
+
 class shared_library_skip(testbase.KcovTestCase):
     def runTest(self):
         self.setUp()
@@ -98,6 +147,20 @@ class shared_library_accumulate(testbase.KcovTestCase):
         assert parse_cobertura.hitsPerLine(dom, "solib.c", 5) == 1
         assert parse_cobertura.hitsPerLine(dom, "solib.c", 10) == 1
 
+class shared_library_skip_covered(testbase.KcovTestCase):
+    def runTest(self):
+        self.setUp()
+        rv,o = self.do(testbase.kcov + " " + testbase.outbase + "/kcov " + testbase.testbuild + "/shared_library_test", False)
+        assert rv == 0
+        rv,o = self.do(testbase.kcov + " --skip-covered " + testbase.outbase + "/kcov " + testbase.testbuild + "/shared_library_test 5", False)
+        assert rv == 0
+
+        dom = parse_cobertura.parseFile(testbase.outbase + "/kcov/shared_library_test/cobertura.xml")
+        assert parse_cobertura.hitsPerLine(dom, "main.c", 9) == 1
+        assert parse_cobertura.hitsPerLine(dom, "solib.c", 5) == 1
+        assert parse_cobertura.hitsPerLine(dom, "solib.c", 10) == 1
+        assert parse_cobertura.hitsPerLine(dom, "solib.c", 12) == 1
+
 class MainTestBase(testbase.KcovTestCase):
     def doTest(self, verify):
         self.setUp()
@@ -123,6 +186,104 @@ class main_test_verify(MainTestBase):
     def runTest(self):
         self.doTest("--verify")
 
+class main_test_pipelined_reporting(MainTestBase):
+    def runTest(self):
+        self.doTest("--pipelined-reporting")
+
+class main_test_trap_handler(MainTestBase):
+    def runTest(self):
+        self.doTest("--trap-handler")
+
+class main_test_coalesce_lines(MainTestBase):
+    def runTest(self):
+        self.doTest("--coalesce-lines")
+
+class coalesce_lines_one_hit(testbase.KcovTestCase):
+    def runTest(self):
+        self.setUp()
+        # ENGINE_MSG | BP_MSG
+        rv,o = self.do(testbase.kcov + " --coalesce-lines --debug=10 " + testbase.outbase + "/kcov " + testbase.testbuild + "/coalesce-lines", False)
+        assert rv == 0
+
+        dom = parse_cobertura.parseFile(testbase.outbase + "/kcov/coalesce-lines/cobertura.xml")
+        assert parse_cobertura.hitsPerLine(dom, "coalesce-lines.c", 9) == 1
+
+        stops = []
+        siblings = []
+        for line in o.decode().split("\n"):
+            if line.startswith("PT BP at "):
+                stops.append(int(line.split()[3].split(":")[0], 16))
+            elif line.startswith("BP coalesced "):
+                siblings.append(int(line.split()[2], 16))
+
+        # The other addresses on the loop line are cleared, and never stop
+        assert len(siblings) >= 2
+        for addr in siblings:
+            assert addr not in stops
+
+class main_test_lazy_arming(MainTestBase):
+    def runTest(self):
+        self.doTest("--lazy-arming")
+
+class main_test_functions_only(testbase.KcovTestCase):
+    def runTest(self):
+        self.setUp()
+        rv,o = self.do(testbase.kcov + " --functions-only " + testbase.outbase + "/kcov " + testbase.testbuild + "/main-tests", False)
+        assert rv == 0
+
+        dom = parse_cobertura.parseFile(testbase.outbase + "/kcov/main-tests/cobertura.xml")
+        assert parse_cobertura.hitsPerLine(dom, "main.cc", 21) == 1
+        assert parse_cobertura.hitsPerLine(dom, "main.cc", 22) == None
+        assert parse_cobertura.hitsPerLine(dom, "file.c", 5) == 1
+        assert parse_cobertura.hitsPerLine(dom, "file.c", 6) == None
+
+class main_test_pin_cpu(MainTestBase):
+    def runTest(self):
+        self.doTest("--pin-cpu")
+
+class main_test_early_detach(MainTestBase):
+    def runTest(self):
+        self.doTest("--early-detach=100")
+
+class main_test_line_cache(MainTestBase):
+    def runTest(self):
+        cache = testbase.outbase + "/line-cache"
+        os.system("rm -rf %s" % (cache))
+
+        # Filled by the first run, used by the second
+        self.doTest("--line-cache=" + cache)
+        assert len(os.listdir(cache)) > 0
+        self.doTest("--line-cache=" + cache)
+
+class main_test_line_cache_filtered(testbase.KcovTestCase):
+    def runTest(self):
+        cache = testbase.outbase + "/line-cache-filtered"
+
+        # The functions of main.cc must be filtered out also when replayed
+        for mode in ["--lazy-arming", "--functions-only"]:
+            os.system("rm -rf %s" % (cache))
+            hits = []
+            for run in ["cold", "warm"]:
+                self.setUp()
+                rv,o = self.do(testbase.kcov + " " + mode + " --include-pattern=file --line-cache=" + cache + " " + testbase.outbase + "/kcov " + testbase.testbuild + "/main-tests", False)
+                assert rv == 0
+
+                dom = parse_cobertura.parseFile(testbase.outbase + "/kcov/main-tests/cobertura.xml")
+                hits.append([parse_cobertura.hitsPerLine(dom, "main.cc", 21),
+                    parse_cobertura.hitsPerLine(dom, "file.c", 5),
+                    parse_cobertura.hitsPerLine(dom, "file.c", 6)])
+            assert hits[0] == hits[1]
+            assert hits[1][0] == None
+            assert hits[1][1] == 1
+
+class main_test_trap_handler_startup(MainTestBase):
+    def runTest(self):
+        self.doTest("--trap-handler=startup")
+
+class main_test_uprobes(MainTestBase):
+    def runTest(self):
+        self.doTest("--uprobes")
+
 
 class popen_test(testbase.KcovTestCase):
     def runTest(self):
@@ -189,6 +350,16 @@ class global_ctors(testbase.KcovTestCase):
         dom = parse_cobertura.parseFile(testbase.outbase + "/kcov/global-constructors/cobertura.xml")
         assert parse_cobertura.hitsPerLine(dom, "test-global-ctors.cc", 4) >= 1
 
+class global_ctors_pie(testbase.KcovTestCase):
+    def runTest(self):
+        self.setUp()
+        noKcovRv,o = self.do(testbase.testbuild + "/global-constructors-pie", False)
+        rv,o = self.do(testbase.kcov + " " + testbase.outbase + "/kcov " + testbase.testbuild + "/global-constructors-pie", False)
+        assert rv == noKcovRv
+
+        dom = parse_cobertura.parseFile(testbase.outbase + "/kcov/global-constructors-pie/cobertura.xml")
+        assert parse_cobertura.hitsPerLine(dom, "test-global-ctors.cc", 4) >= 1
+
 class daemon_wait_for_last_child(testbase.KcovTestCase):
     def runTest(self):
         self.setUp()
@@ -273,6 +444,94 @@ class attach_process_with_threads(testbase.KcovTestCase):
         assert parse_cobertura.hitsPerLine(dom, "test-issue31.cc", 11) >= 1
         assert parse_cobertura.hitsPerLine(dom, "test-issue31.cc", 8) == 0
 
+class DetachTestBase(testbase.KcovTestCase):
+    def readStatus(self, path):
+        # Rounds, crashed children
+        return [int(x) for x in open(path).read().split()]
+
+    def tracers(self, pid):
+        out = []
+        for tid in os.listdir("/proc/%d/task" % (pid)):
+            for line in open("/proc/%d/task/%s/status" % (pid, tid)):
+                if line.startswith("TracerPid:"):
+                    out.append(int(line.split()[1]))
+        return out
+
+    def childPid(self, ppid, name):
+        for entry in os.listdir("/proc"):
+            if not entry.isdigit():
+                continue
+            try:
+                stat = open("/proc/%s/stat" % (entry)).read()
+            except IOError:
+                continue
+            # pid (comm) state ppid ...
+            comm = stat[stat.find("(") + 1:stat.rfind(")")]
+            fields = stat[stat.rfind(")") + 2:].split()
+            if comm == name and int(fields[1]) == ppid:
+                return int(entry)
+        return None
+
+    # The program must keep running untraced, and no child may die on a leftover breakpoint
+    def checkDetached(self, pid, status):
+        before = self.readStatus(status)
+        time.sleep(0.5)
+        after = self.readStatus(status)
+
+        assert after[0] > before[0]
+        assert after[1] == 0
+        assert self.tracers(pid) == [0] * len(self.tracers(pid))
+
+class attach_window_with_forks(DetachTestBase):
+    def runTest(self):
+        self.setUp()
+        status = testbase.outbase + "/fork-loop.status"
+        prg = subprocess.Popen([testbase.testbuild + "/fork-loop", status])
+        time.sleep(0.5)
+
+        try:
+            rv,o = self.do(testbase.kcov + " --pid=%d --attach-window=1 " % (prg.pid) + testbase.outbase + "/kcov", False)
+            assert rv == 0
+            self.checkDetached(prg.pid, status)
+        finally:
+            prg.kill()
+            prg.wait()
+
+        dom = parse_cobertura.parseFile(testbase.outbase + "/kcov/fork-loop/cobertura.xml")
+        assert parse_cobertura.hitsPerLine(dom, "test-fork-loop.c", 39) >= 1
+
+class early_detach_with_forks(DetachTestBase):
+    def runTest(self):
+        self.setUp()
+        status = testbase.outbase + "/fork-loop.status"
+        if os.path.exists(status):
+            os.remove(status)
+        kcov = subprocess.Popen((testbase.kcov + " --early-detach=100 " + testbase.outbase + "/kcov " + testbase.testbuild + "/fork-loop " + status).split())
+
+        try:
+            # Every line is hit in the first round, so kcov detaches soon after
+            time.sleep(2)
+            pid = self.childPid(kcov.pid, "fork-loop")
+            assert pid != None
+            self.checkDetached(pid, status)
+
+            # kcov is still waiting for the program, and exits with it
+            assert kcov.poll() == None
+            os.kill(pid, 9)
+            for i in range(100):
+                if kcov.poll() != None:
+                    break
+                time.sleep(0.1)
+            assert kcov.poll() != None
+        finally:
+            if kcov.poll() == None:
+                kcov.kill()
+                kcov.wait()
+
+        dom = parse_cobertura.parseFile(testbase.outbase + "/kcov/fork-loop/cobertura.xml")
+        assert parse_cobertura.hitsPerLine(dom, "test-fork-loop.c", 21) >= 1
+        assert parse_cobertura.hitsPerLine(dom, "test-fork-loop.c", 39) >= 1
+
 class merge_same_file_in_multiple_binaries(testbase.KcovTestCase):
     def runTest(self):
         self.setUp()
@@ -0,0 +1,151 @@
+#include "test.hh"
+
+#include "../../src/parsers/dwarf-cache.hh"
+
+#include <filter.hh>
+#include <utils.hh>
+
+#include <string>
+#include <vector>
+#include <stdlib.h>
+#include <unistd.h>
+
+using namespace kcov;
+
+class CacheListener : public IFileParser::ILineListener, public IFileParser::IFunctionListener
+{
+public:
+	void onLine(const std::string &file, unsigned int lineNr, uint64_t addr)
+	{
+		m_lines.push_back(fmt("%s:%u:0x%llx", file.c_str(), lineNr, (unsigned long long)addr));
+	}
+
+	void onFunction(uint64_t start, uint64_t end)
+	{
+		m_functions.push_back(fmt("0x%llx-0x%llx", (unsigned long long)start, (unsigned long long)end));
+	}
+
+	std::vector<std::string> m_lines;
+	std::vector<std::string> m_functions;
+};
+
+// Only the files below /src/a
+class PrefixFilter : public IFilter
+{
+public:
+	bool runFilters(const std::string &path)
+	{
+		return path.find("/src/a") == 0;
+	}
+
+	std::string mangleSourcePath(const std::string &path)
+	{
+		return path;
+	}
+};
+
+TESTSUITE(dwarf_cache)
+{
+	TEST(storeAndLoad)
+	{
+		char buf[] = "/tmp/kcov-dwarf-cache.XXXXXX";
+		std::string dir = std::string(mkdtemp(buf)) + "/a/b";
+
+		DwarfCache miss(dir, "0011aabb");
+		ASSERT_FALSE(miss.load());
+
+		DwarfCache writer(dir, "0011aabb");
+		CacheListener written;
+
+		writer.onFunction(0x1000, 0x1040);
+		writer.onLine("/src/a.c", 5, 0x1000);
+		writer.onLine("/src/b.c", 9, 0x1010);
+		writer.onLine("/src/a.c", 6, 0x1020);
+		ASSERT_TRUE(writer.store());
+
+		// The same from memory as from the file
+		writer.replay(written, &written);
+		ASSERT_TRUE(written.m_functions.size() == 1);
+		ASSERT_TRUE(written.m_lines.size() == 3);
+
+		DwarfCache reader(dir, "0011aabb");
+		CacheListener read;
+
+		ASSERT_TRUE(reader.load());
+		reader.replay(read, &read);
+		ASSERT_TRUE(read.m_functions == written.m_functions);
+		ASSERT_TRUE(read.m_lines == written.m_lines);
+		ASSERT_TRUE(read.m_lines[2] == "/src/a.c:6:0x1020");
+
+		// Without functions
+		CacheListener linesOnly;
+
+		reader.replay(linesOnly, NULL);
+		ASSERT_TRUE(linesOnly.m_functions.empty());
+		ASSERT_TRUE(linesOnly.m_lines.size() == 3);
+
+		// Broken entries are ignored
+		std::string path = dir + "/0011aabb.lines";
+		size_t sz;
+		uint8_t *data = (uint8_t *)read_file(&sz, "%s", path.c_str());
+
+		ASSERT_TRUE(data);
+		ASSERT_TRUE(write_file(data, sz - 1, "%s", path.c_str()) == 0);
+		free(data);
+
+		DwarfCache truncated(dir, "0011aabb");
+		ASSERT_FALSE(truncated.load());
+
+		unlink(path.c_str());
+		rmdir(dir.c_str());
+		rmdir((std::string(buf) + "/a").c_str());
+		rmdir(buf);
+	}
+
+	TEST(filteredFunctions)
+	{
+		char buf[] = "/tmp/kcov-dwarf-cache.XXXXXX";
+		std::string dir = mkdtemp(buf);
+		std::vector<std::string> aFiles;
+		std::vector<std::string> bFiles;
+
+		aFiles.push_back("/src/a.c");
+		aFiles.push_back("/src/common.h");
+		bFiles.push_back("/src/b.c");
+		bFiles.push_back("/src/common.h");
+
+		DwarfCache writer(dir, "0011aabb");
+
+		writer.onCu(&aFiles);
+		writer.onFunction(0x1000, 0x1040);
+		writer.onCu(&bFiles);
+		writer.onFunction(0x2000, 0x2040);
+		writer.onFunction(0x2040, 0x2080);
+		writer.onCu(NULL);
+		writer.onFunction(0x3000, 0x3040);
+		writer.onLine("/src/a.c", 5, 0x1000);
+		writer.onLine("/src/b.c", 9, 0x2000);
+		ASSERT_TRUE(writer.store());
+
+		DwarfCache reader(dir, "0011aabb");
+		CacheListener all;
+		CacheListener filtered;
+		PrefixFilter filter;
+
+		ASSERT_TRUE(reader.load());
+		reader.replay(all, &all);
+		ASSERT_TRUE(all.m_functions.size() == 4);
+		ASSERT_TRUE(all.m_lines.size() == 2);
+
+		// The CU of b.c is filtered out, the one with unknown files is not
+		reader.replay(filtered, &filtered, &filter);
+		ASSERT_TRUE(filtered.m_functions.size() == 2);
+		ASSERT_TRUE(filtered.m_functions[0] == "0x1000-0x1040");
+		ASSERT_TRUE(filtered.m_functions[1] == "0x3000-0x3040");
+		ASSERT_TRUE(filtered.m_lines.size() == 1);
+		ASSERT_TRUE(filtered.m_lines[0] == "/src/a.c:5:0x1000");
+
+		unlink((dir + "/0011aabb.lines").c_str());
+		rmdir(buf);
+	}
+}
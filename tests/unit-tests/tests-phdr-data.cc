@@ -0,0 +1,83 @@
+#include "test.hh"
+
+#include <phdr_data.h>
+#include <link.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+TESTSUITE(solib_data)
+{
+	TEST(roundTrip)
+	{
+		struct phdr_data_message msg;
+		struct dl_phdr_info info;
+		ElfW(Phdr) phdrs[3];
+
+		memset(phdrs, 0, sizeof(phdrs));
+		phdrs[0].p_type = PT_LOAD;
+		phdrs[0].p_vaddr = 0x1000;
+		phdrs[0].p_memsz = 0x200;
+		phdrs[1].p_type = PT_DYNAMIC;
+		phdrs[2].p_type = PT_LOAD;
+		phdrs[2].p_vaddr = 0x3000;
+		phdrs[2].p_memsz = 0x80;
+
+		memset(&info, 0, sizeof(info));
+		info.dlpi_addr = 0x40000000;
+		info.dlpi_name = "/lib/libkalle.so";
+		info.dlpi_phdr = phdrs;
+		info.dlpi_phnum = 3;
+
+		phdr_data_message_init(&msg, 0x5000);
+		ASSERT_TRUE(phdr_data_message_add(&msg, &info) == 0);
+		ASSERT_TRUE(phdr_data_message_add_unloaded(&msg, "/lib/libmanne.so") == 0);
+
+		// Variable-length records, not the fixed entries
+		ASSERT_TRUE(msg.size < sizeof(struct phdr_data_entry));
+
+		// Incomplete until all of it is there
+		ASSERT_TRUE(phdr_data_message_size(msg.data, 4) == 0);
+		ASSERT_TRUE(phdr_data_message_size(msg.data, msg.size - 1) == (ssize_t)msg.size);
+		ASSERT_TRUE(phdr_data_unmarshal(msg.data, msg.size - 1) == NULL);
+
+		struct phdr_data *p = phdr_data_unmarshal(msg.data, msg.size);
+
+		ASSERT_TRUE(p);
+		ASSERT_TRUE(p->relocation == 0x5000);
+		ASSERT_TRUE(p->pid == getpid());
+		ASSERT_TRUE(p->n_entries == 2);
+
+		ASSERT_TRUE(strcmp(p->entries[0].name, "/lib/libkalle.so") == 0);
+		ASSERT_TRUE(p->entries[0].flags == 0);
+		ASSERT_TRUE(p->entries[0].n_segments == 2);
+		ASSERT_TRUE(p->entries[0].segments[0].vaddr == 0x40001000);
+		ASSERT_TRUE(p->entries[0].segments[1].vaddr == 0x40003000);
+		ASSERT_TRUE(p->entries[0].segments[1].size == 0x80);
+
+		ASSERT_TRUE(strcmp(p->entries[1].name, "/lib/libmanne.so") == 0);
+		ASSERT_TRUE(p->entries[1].flags == PHDR_DATA_UNLOADED);
+		ASSERT_TRUE(p->entries[1].n_segments == 0);
+
+		free(p);
+		phdr_data_message_free(&msg);
+	}
+
+	TEST(broken)
+	{
+		struct phdr_data_message msg;
+
+		phdr_data_message_init(&msg, 0);
+		ASSERT_TRUE(phdr_data_message_add_unloaded(&msg, "/lib/libkalle.so") == 0);
+
+		// Not NUL-terminated within the record
+		memset(msg.data + msg.size - 8, 'x', 8);
+		ASSERT_TRUE(phdr_data_unmarshal(msg.data, msg.size) == NULL);
+
+		// Bad magic
+		memset(msg.data, 0, 4);
+		ASSERT_TRUE(phdr_data_message_size(msg.data, msg.size) == -1);
+
+		phdr_data_message_free(&msg);
+	}
+}
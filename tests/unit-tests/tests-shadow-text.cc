@@ -0,0 +1,84 @@
+#include "test.hh"
+
+#include <shadow-text.hh>
+#include <string.h>
+#include <stdint.h>
+
+using namespace kcov;
+
+TESTSUITE(shadow_text)
+{
+	TEST(lookup)
+	{
+		IShadowText &shadow = IShadowText::getInstance();
+		uint8_t text[64];
+		uint8_t buf[16];
+
+		for (unsigned int i = 0; i < sizeof(text); i++)
+			text[i] = i;
+
+		shadow.addRegion("a.out", 0x10000, 0x11000, text, sizeof(text), true);
+
+		// Outside, or partly outside, the region
+		ASSERT_TRUE(shadow.lookup(1, 0x10ff0, buf, sizeof(buf)) == IShadowText::SHADOW_MISSING);
+		ASSERT_TRUE(shadow.lookup(1, 0x11038, buf, sizeof(buf)) == IShadowText::SHADOW_MISSING);
+
+		ASSERT_TRUE(shadow.lookup(1, 0x11010, buf, sizeof(buf)) == IShadowText::SHADOW_UNVERIFIED);
+		ASSERT_TRUE(memcmp(buf, &text[0x10], sizeof(buf)) == 0);
+
+		shadow.setVerified(1, 0x11000, true);
+		ASSERT_TRUE(shadow.lookup(1, 0x11020, buf, sizeof(buf)) == IShadowText::SHADOW_VALID);
+		ASSERT_TRUE(memcmp(buf, &text[0x20], sizeof(buf)) == 0);
+
+		// Mismatch with the process, don't use it anymore
+		shadow.setVerified(1, 0x11000, false);
+		ASSERT_TRUE(shadow.lookup(1, 0x11020, buf, sizeof(buf)) == IShadowText::SHADOW_MISSING);
+	}
+
+	TEST(perProcess)
+	{
+		IShadowText &shadow = IShadowText::getInstance();
+		std::vector<uint8_t> data;
+		unsigned long start = 0;
+		uint8_t text[64];
+		uint8_t buf[16];
+
+		memset(text, 0x11, sizeof(text));
+		shadow.addRegion("liba.so", 0x30000, 0x30000, text, sizeof(text), true);
+
+		ASSERT_TRUE(shadow.getRegion(0x30020, start, data));
+		ASSERT_TRUE(start == 0x30000);
+		ASSERT_TRUE(data.size() == sizeof(text));
+
+		// Only valid for the process which verified it
+		shadow.setVerified(10, 0x30000, true);
+		ASSERT_TRUE(shadow.lookup(10, 0x30010, buf, sizeof(buf)) == IShadowText::SHADOW_VALID);
+		ASSERT_TRUE(shadow.lookup(11, 0x30010, buf, sizeof(buf)) == IShadowText::SHADOW_MISSING);
+
+		// Replaced, e.g., by a dlopen in another process
+		memset(text, 0x22, sizeof(text));
+		shadow.addRegion("libb.so", 0x30000, 0x30000, text, sizeof(text), true);
+		ASSERT_TRUE(shadow.lookup(10, 0x30010, buf, sizeof(buf)) == IShadowText::SHADOW_UNVERIFIED);
+		ASSERT_TRUE(buf[0] == 0x22);
+	}
+
+	TEST(untrustedAndReplaced)
+	{
+		IShadowText &shadow = IShadowText::getInstance();
+		std::vector<uint8_t> data;
+		unsigned long start = 0;
+		uint8_t text[32];
+		uint8_t buf[8];
+
+		memset(text, 0xaa, sizeof(text));
+		shadow.addRegion("libtextrel.so", 0x20000, 0x20000, text, sizeof(text), false);
+		ASSERT_TRUE(shadow.lookup(1, 0x20000, buf, sizeof(buf)) == IShadowText::SHADOW_MISSING);
+		ASSERT_TRUE(!shadow.getRegion(0x20000, start, data));
+
+		// Another module loaded at the same place
+		memset(text, 0x55, sizeof(text));
+		shadow.addRegion("libother.so", 0x20000, 0x20000, text, sizeof(text), true);
+		ASSERT_TRUE(shadow.lookup(1, 0x20008, buf, sizeof(buf)) == IShadowText::SHADOW_UNVERIFIED);
+		ASSERT_TRUE(buf[0] == 0x55);
+	}
+}
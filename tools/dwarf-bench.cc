@@ -0,0 +1,125 @@
+#include <file-parser.hh>
+#include <utils.hh>
+
+#include "../src/parsers/dwarf.hh"
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <functional>
+#include <vector>
+
+using namespace kcov;
+
+/*
+ * Time the DWARF line parsing of a binary with different numbers of
+ * threads. The lines must come in the same order with all of them, which
+ * is checked with a hash.
+ */
+class Listener : public IFileParser::ILineListener
+{
+public:
+	Listener() :
+		m_fileHash(0),
+		m_lines(0),
+		m_hash(0)
+	{
+	}
+
+	void onLine(const std::string &file, unsigned int lineNr, uint64_t addr)
+	{
+		if (file != m_lastFile) {
+			m_lastFile = file;
+			m_fileHash = std::hash<std::string>()(file);
+		}
+
+		m_hash = m_hash * 31 + m_fileHash + lineNr * 7 + addr;
+		m_lines++;
+	}
+
+	std::string m_lastFile;
+	size_t m_fileHash;
+	uint64_t m_lines;
+	uint64_t m_hash;
+};
+
+static uint64_t run(const std::string &file, unsigned int threads, Listener &listener)
+{
+	DwarfParser dp;
+
+	if (!dp.open(file)) {
+		fprintf(stderr, "Can't open %s\n", file.c_str());
+		exit(1);
+	}
+
+	dp.setThreads(threads);
+
+	uint64_t start = get_ms_timestamp();
+
+	dp.forEachLine(listener);
+
+	return get_ms_timestamp() - start;
+}
+
+int main(int argc, const char *argv[])
+{
+	if (argc < 2) {
+		fprintf(stderr, "Usage: dwarf-bench in-file [max-threads]\n");
+		return 1;
+	}
+
+	std::string file(argv[1]);
+	unsigned int maxThreads;
+	cpu_set_t set;
+
+	if (argc >= 3) {
+		if (!string_is_integer(argv[2]) || string_to_integer(argv[2]) < 1) {
+			fprintf(stderr, "max-threads argument (%s) must be a positive integer\n", argv[2]);
+			return 1;
+		}
+		maxThreads = string_to_integer(argv[2]);
+	} else {
+		maxThreads = sched_getaffinity(0, sizeof(set), &set) == 0 ? CPU_COUNT(&set) : 1;
+	}
+
+	// Powers of two, and the maximum
+	std::vector<unsigned int> threadCounts;
+
+	for (unsigned int threads = 1; threads < maxThreads; threads *= 2)
+		threadCounts.push_back(threads);
+	threadCounts.push_back(maxThreads);
+
+	uint64_t base = 0;
+	uint64_t baseHash = 0;
+
+	printf("threads      ms  speedup     lines\n");
+	for (std::vector<unsigned int>::const_iterator it = threadCounts.begin();
+			it != threadCounts.end();
+			++it) {
+		unsigned int threads = *it;
+		uint64_t best = 0;
+		Listener listener;
+
+		// Best of three, the first also warms the page cache
+		for (unsigned int i = 0; i < 3; i++) {
+			Listener cur;
+			uint64_t ms = run(file, threads, cur);
+
+			if (i == 0 || ms < best)
+				best = ms;
+			listener = cur;
+		}
+
+		if (threads == 1) {
+			base = best;
+			baseHash = listener.m_hash;
+		}
+
+		printf("%7u %7llu %7.2fx %9llu%s\n", threads, (unsigned long long)best,
+				best ? (double)base / best : 0.0, (unsigned long long)listener.m_lines,
+				listener.m_hash == baseHash ? "" : "  (DIFFERENT LINES!)");
+	}
+
+	return 0;
+}